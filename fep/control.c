@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <byteswap.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>		/* offsetof */
@@ -130,17 +131,68 @@ _fep_close_control_socket (Fep *fep)
   free (fep->control_socket_path);
 }
 
+/* The keys CLIENT wants depend on whether it is composing, with
+   FEP_KEY_SUBSCRIBE_COMPOSING.  */
+static void
+set_composing (Fep *fep, FepControlClient *client, bool composing)
+{
+  if (client->composing != composing)
+    {
+      client->composing = composing;
+      fep->subscription_serial++;
+    }
+}
+
 static void
 command_set_cursor_text (Fep *fep,
+			 FepControlClient *client,
 			 FepControlMessage *request)
 {
   FepAttribute attr;
   if (_fep_control_message_read_attribute_arg (request, 1, &attr) == 0)
     _fep_output_cursor_text (fep, request->args[0].str, &attr);
+  free (client->cursor_text);
+  client->cursor_text = xstrndup (request->args[0].str, request->args[0].len);
+  set_composing (fep, client, *client->cursor_text != '\0');
+}
+
+static void
+command_set_cursor_text_delta (Fep *fep,
+			       FepControlClient *client,
+			       FepControlMessage *request)
+{
+  const char *base = client->cursor_text ? client->cursor_text : "";
+  size_t base_length = strlen (base);
+  FepString *data = &request->args[2];
+  FepAttribute attr;
+  uint32_t start, end;
+  char *text;
+
+  if (_fep_control_message_read_uint32_arg (request, 0, &start) < 0
+      || _fep_control_message_read_uint32_arg (request, 1, &end) < 0
+      || _fep_control_message_read_attribute_arg (request, 3, &attr) < 0
+      || start > end
+      || end > base_length
+      || memchr (data->str, '\0', data->len) != NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "malformed SET_CURSOR_TEXT_DELTA");
+      return;
+    }
+
+  text = xcharalloc (base_length - (end - start) + data->len + 1);
+  memcpy (text, base, start);
+  memcpy (text + start, data->str, data->len);
+  memcpy (text + start + data->len, base + end, base_length - end + 1);
+
+  _fep_output_cursor_text (fep, text, &attr);
+  free (client->cursor_text);
+  client->cursor_text = text;
+  set_composing (fep, client, *text != '\0');
 }
 
 static void
 command_set_status_text (Fep *fep,
+			 FepControlClient *client,
 			 FepControlMessage *request)
 {
   FepAttribute attr;
@@ -150,6 +202,7 @@ command_set_status_text (Fep *fep,
 
 static void
 command_send_text (Fep *fep,
+		   FepControlClient *client,
 		   FepControlMessage *request)
 {
   _fep_output_send_text (fep, request->args[0].str);
@@ -157,6 +210,7 @@ command_send_text (Fep *fep,
 
 static void
 command_send_data (Fep *fep,
+		   FepControlClient *client,
 		   FepControlMessage *request)
 {
   ssize_t total = 0;
@@ -174,92 +228,309 @@ command_send_data (Fep *fep,
 
 static void
 command_forward_key_event (Fep *fep,
+			   FepControlClient *client,
 			   FepControlMessage *request)
 {
   uint32_t keyval, modifiers;
   if (_fep_control_message_read_uint32_arg (request, 0, &keyval) == 0
       && _fep_control_message_read_uint32_arg (request, 1, &modifiers) == 0)
+    _fep_output_send_key (fep, keyval, modifiers);
+}
+
+static void
+command_subscribe_keys (Fep *fep,
+			FepControlClient *client,
+			FepControlMessage *request)
+{
+  uint32_t flags;
+  size_t i, n_patterns;
+  const char *p;
+
+  if (_fep_control_message_read_uint32_arg (request, 0, &flags) < 0
+      || request->args[1].len % (3 * sizeof(uint32_t)) != 0)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "malformed SUBSCRIBE_KEYS");
+      return;
+    }
+
+  n_patterns = request->args[1].len / (3 * sizeof(uint32_t));
+  free (client->key_patterns);
+  client->key_patterns = xcalloc (n_patterns, sizeof(FepKeyPattern));
+  for (i = 0, p = request->args[1].str; i < n_patterns; i++)
     {
-      size_t length;
-      char *data = _fep_key_to_string (keyval, modifiers, &length);
-      if (data)
+      uint32_t val[3];
+
+      memcpy (val, p, sizeof(val));
+      p += sizeof(val);
+#ifdef WORDS_BIGENDIAN
+      val[0] = bswap_32 (val[0]);
+      val[1] = bswap_32 (val[1]);
+      val[2] = bswap_32 (val[2]);
+#endif
+      client->key_patterns[i].keyval = val[0];
+      client->key_patterns[i].modifiers = val[1];
+      client->key_patterns[i].modifiers_mask = val[2];
+    }
+  client->n_key_patterns = n_patterns;
+  client->key_flags = flags;
+  client->key_subscribed = true;
+  fep->subscription_serial++;
+}
+
+bool
+_fep_control_client_wants_key (FepControlClient *client,
+			       uint32_t          keyval,
+			       uint32_t          state)
+{
+  size_t i;
+
+  if (!client->key_subscribed
+      || client->key_flags & FEP_KEY_SUBSCRIBE_ALL
+      || (client->key_flags & FEP_KEY_SUBSCRIBE_COMPOSING
+	  && client->composing))
+    return true;
+
+  for (i = 0; i < client->n_key_patterns; i++)
+    {
+      const FepKeyPattern *pattern = &client->key_patterns[i];
+      if (pattern->keyval == keyval
+	  && (state & pattern->modifiers_mask) == pattern->modifiers)
+	return true;
+    }
+  return false;
+}
+
+static void
+command_register (Fep *fep,
+		  FepControlClient *client,
+		  FepControlMessage *request)
+{
+  uint32_t priority, flags;
+
+  if (_fep_control_message_read_uint32_arg (request, 0, &priority) == 0
+      && _fep_control_message_read_uint32_arg (request, 1, &flags) == 0)
+    {
+      client->priority = (int32_t) priority;
+      client->observer = (flags & FEP_CLIENT_OBSERVER) != 0;
+    }
+}
+
+static void
+command_begin (Fep *fep,
+	       FepControlClient *client,
+	       FepControlMessage *request)
+{
+  client->transaction_depth++;
+}
+
+static void
+command_commit (Fep *fep,
+		FepControlClient *client,
+		FepControlMessage *request)
+{
+  if (client->transaction_depth == 0)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "COMMIT without BEGIN");
+      return;
+    }
+
+  if (--client->transaction_depth > 0)
+    return;
+
+  /* apply the queued changes and render them at once */
+  _fep_output_hold (fep);
+  while (client->transaction)
+    {
+      FepList *_head = client->transaction;
+      FepControlMessage *_message = _head->data;
+
+      client->transaction = _head->next;
+
+      _fep_dispatch_control_message (fep, client, _message);
+      _fep_control_message_free (_message);
+      free (_head);
+    }
+  _fep_output_release (fep);
+}
+
+static void
+command_setup_shm (Fep *fep,
+		   FepControlClient *client,
+		   FepControlMessage *request)
+{
+  FepControlMessage response;
+  int fds[FEP_SHM_N_FDS];
+  bool accepted;
+
+  accepted = client->shm == NULL && _fep_shm_create (fds) == 0;
+
+  _fep_control_message_init (&response, FEP_CONTROL_RESPONSE);
+  _fep_control_message_write_uint8_arg (&response, 0, FEP_CONTROL_SETUP_SHM);
+  _fep_control_message_write_uint32_arg (&response, 1, accepted ? 1 : 0);
+  _fep_write_control_message (client->fd, &response);
+  _fep_control_message_free_args (&response);
+
+  if (accepted)
+    {
+      if (_fep_send_fds (client->fd, fds, FEP_SHM_N_FDS) == 0)
+	client->shm = _fep_shm_new (fds, true, client->fd);
+      else
 	{
-	  _fep_output_send_data (fep, data, length);
-	  free (data);
+	  int i;
+	  for (i = 0; i < FEP_SHM_N_FDS; i++)
+	    close (fds[i]);
 	}
     }
 }
 
-int
-_fep_read_control_message_from_fd (Fep               *fep,
-                                   int                fd,
-                                   FepControlMessage *message)
+void
+_fep_close_control_client (Fep              *fep,
+                           FepControlClient *client)
 {
-  int i;
+  int i = client - fep->clients;
 
-  if (_fep_read_control_message (fd, message) < 0)
+  if (client->shm)
+    _fep_shm_free (client->shm);
+  /* an unfinished transaction is discarded */
+  while (client->transaction)
     {
-      for (i = 0; i < fep->n_clients; i++)
-	if (fep->clients[i] == fd)
-	  {
-	    close (fd);
-	    if (i + 1 < fep->n_clients)
-	      memmove (&fep->clients[i],
-		       &fep->clients[i + 1],
-		       fep->n_clients - (i + 1));
-	    fep->clients[--fep->n_clients] = -1;
-	    break;
-	  }
-      return -1;
-    }
+      FepList *_head = client->transaction;
 
-  return 0;
+      client->transaction = _head->next;
+      _fep_control_message_free (_head->data);
+      free (_head);
+    }
+  free (client->key_patterns);
+  free (client->cursor_text);
+  close (client->fd);
+  if (i + 1 < fep->n_clients)
+    memmove (&fep->clients[i],
+	     &fep->clients[i + 1],
+	     (fep->n_clients - (i + 1)) * sizeof(FepControlClient));
+  fep->n_clients--;
+  memset (&fep->clients[fep->n_clients], 0, sizeof(FepControlClient));
+  fep->clients[fep->n_clients].fd = -1;
+  fep->subscription_serial++;
 }
 
+int
+_fep_read_control_message_from_client (Fep               *fep,
+                                       FepControlClient  *client,
+                                       FepControlMessage *message)
+{
+  int retval;
+
+  if (client->shm)
+    retval = _fep_shm_read_control_message (client->shm, message, false);
+  else
+    retval = _fep_read_control_message (client->fd, message);
+
+  if (retval < 0)
+    _fep_close_control_client (fep, client);
+
+  return retval;
+}
 
 int
-_fep_dispatch_control_message (Fep *fep, FepControlMessage *message)
+_fep_dispatch_control_message (Fep               *fep,
+                               FepControlClient  *client,
+                               FepControlMessage *message)
 {
-  static const struct
-  {
-    int command;
-    void (*handler) (Fep *fep,
-		     FepControlMessage *request);
-  } handlers[] =
+  static void (*const handlers[FEP_CONTROL_COMMAND_LAST]) (Fep *fep,
+							   FepControlClient *client,
+							   FepControlMessage *request) =
       {
-	{ FEP_CONTROL_SET_CURSOR_TEXT, command_set_cursor_text },
-	{ FEP_CONTROL_SET_STATUS_TEXT, command_set_status_text },
-	{ FEP_CONTROL_SEND_TEXT, command_send_text },
-	{ FEP_CONTROL_SEND_DATA, command_send_data },
-	{ FEP_CONTROL_FORWARD_KEY_EVENT, command_forward_key_event }
+#define HANDLER_SERVER(NAME, name) [FEP_CONTROL_##NAME] = command_##name,
+#define HANDLER_CLIENT(NAME, name)
+#define HANDLER_NOTIFY(NAME, name)
+#define HANDLER_RESPONSE(NAME, name)
+#define FEP_CONTROL_COMMAND(NAME, name, value, direction,	\
+			    arg0, arg1, arg2, arg3, compact, coalesce)	\
+	HANDLER_##direction (NAME, name)
+#include <libfep/control.def>
+#undef FEP_CONTROL_COMMAND
+#undef HANDLER_SERVER
+#undef HANDLER_CLIENT
+#undef HANDLER_NOTIFY
+#undef HANDLER_RESPONSE
       };
-  int i;
 
-  for (i = 0;
-       i < SIZEOF (handlers) && handlers[i].command != message->command;
-       i++)
-    ;
-  if (i == SIZEOF (handlers))
+  if (message->command >= FEP_CONTROL_COMMAND_LAST
+      || handlers[message->command] == NULL)
     {
       fep_log (FEP_LOG_LEVEL_WARNING,
 	       "no handler defined for %d", message->command);
       return -1;
     }
 
-  handlers[i].handler (fep, message);
+  if (client->transaction_depth > 0
+      && message->command != FEP_CONTROL_BEGIN
+      && message->command != FEP_CONTROL_COMMIT)
+    {
+      client->transaction = _fep_append_control_message (client->transaction,
+							 message);
+      return 0;
+    }
+
+  _fep_output_hold (fep);
+  handlers[message->command] (fep, client, message);
+  _fep_output_release (fep);
+  return 0;
+}
+
+int
+_fep_write_control_message_to_client (Fep               *fep,
+                                      FepControlClient  *client,
+                                      FepControlMessage *message)
+{
+  if (client->shm)
+    return _fep_shm_write_control_message (client->shm, message, true);
+  return _fep_write_control_message (client->fd, message);
+}
+
+/* Send the notification MESSAGE to CLIENT without blocking, so that a
+   client which doesn't keep up can't stall the input.  It loses the
+   message instead, and is closed after too many losses in a row.
+   Returns -1 if CLIENT has been closed.  */
+int
+_fep_notify_control_client (Fep               *fep,
+                            FepControlClient  *client,
+                            FepControlMessage *message)
+{
+  int retval;
+
+  if (client->shm)
+    retval = _fep_shm_write_control_message (client->shm, message, false);
+  else
+    retval = _fep_write_control_message_nonblock (client->fd, message);
+
+  if (retval == 0)
+    client->n_dropped = 0;
+  else if (retval > 0 && ++client->n_dropped < FEP_MAX_DROPPED)
+    fep_log (FEP_LOG_LEVEL_DEBUG,
+	     "dropped notification to %d",
+	     client->fd);
+  else
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "closing client %d, which can't take notifications",
+	       client->fd);
+      _fep_close_control_client (fep, client);
+      return -1;
+    }
   return 0;
 }
 
 int
 _fep_transceive_control_message (Fep               *fep,
-                                 int                fd,
+                                 FepControlClient  *client,
                                  FepControlMessage *request,
                                  FepControlMessage *response)
 {
   FepList *messages = NULL;
   int retval = 0;
 
-  retval = _fep_write_control_message (fd, request);
+  retval = _fep_write_control_message_to_client (fep, client, request);
   if (retval < 0)
     return retval;
 
@@ -267,9 +538,15 @@ _fep_transceive_control_message (Fep               *fep,
     {
       FepControlMessage message;
 
-      retval = _fep_read_control_message (fd, &message);
+      if (client->shm)
+	retval = _fep_shm_read_control_message (client->shm, &message, true);
+      else
+	retval = _fep_read_control_message (client->fd, &message);
       if (retval < 0)
 	goto out;
+      /* spurious wakeup of the shared memory transport */
+      if (retval > 0)
+	continue;
 
       if (message.command == FEP_CONTROL_RESPONSE)
 	{
@@ -322,7 +599,7 @@ _fep_transceive_control_message (Fep               *fep,
 
       messages = _head->next;
 
-      _fep_dispatch_control_message (fep, _message);
+      _fep_dispatch_control_message (fep, client, _message);
       _fep_control_message_free (_message);
       free (_head);
     }
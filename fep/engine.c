@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2012 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private.h"
+#include <dlfcn.h>
+#include <string.h>
+#include <stdlib.h>
+
+static void
+host_send_text (FepEngineHost *host, const char *text)
+{
+  _fep_output_send_text (host->data, text);
+}
+
+static void
+host_send_data (FepEngineHost *host, const char *data, size_t length)
+{
+  size_t total = 0;
+
+  while (total < length)
+    {
+      ssize_t bytes_sent = _fep_output_send_data (host->data,
+						  data + total,
+						  length - total);
+      if (bytes_sent < 0)
+	break;
+      total += bytes_sent;
+    }
+}
+
+static void
+host_forward_key_event (FepEngineHost  *host,
+			unsigned int    keyval,
+			FepModifierType modifiers)
+{
+  _fep_output_send_key (host->data, keyval, modifiers);
+}
+
+/* Load an input method engine from the shared object PATH, which
+   handles key events before the clients connected through the
+   control socket.  */
+int
+fep_load_engine (Fep *fep, const char *path, const char *args)
+{
+  void *module;
+  FepEngineNewFunc engine_new;
+  FepEngine *engine;
+
+  if (fep->engine)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "engine already loaded");
+      return -1;
+    }
+
+  module = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+  if (module == NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "can't load engine %s: %s",
+	       path, dlerror ());
+      return -1;
+    }
+
+  engine_new = (FepEngineNewFunc) dlsym (module, FEP_ENGINE_ENTRY_POINT);
+  if (engine_new == NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "can't find %s in %s",
+	       FEP_ENGINE_ENTRY_POINT, path);
+      dlclose (module);
+      return -1;
+    }
+
+  fep->engine_host.send_text = host_send_text;
+  fep->engine_host.send_data = host_send_data;
+  fep->engine_host.forward_key_event = host_forward_key_event;
+  fep->engine_host.data = fep;
+
+  engine = engine_new (&fep->engine_host, args);
+  if (engine == NULL || engine->abi_version != FEP_ENGINE_ABI_VERSION)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "can't initialize engine %s", path);
+      if (engine && engine->free)
+	engine->free (engine);
+      dlclose (module);
+      return -1;
+    }
+
+  fep->engine = engine;
+  fep->engine_module = module;
+  memset (&fep->engine_cursor_text_attr, 0, sizeof(FepAttribute));
+  fep->engine_cursor_text_attr.type = FEP_ATTR_TYPE_NONE;
+  memset (&fep->engine_status_text_attr, 0, sizeof(FepAttribute));
+  fep->engine_status_text_attr.type = FEP_ATTR_TYPE_NONE;
+  return 0;
+}
+
+void
+_fep_unload_engine (Fep *fep)
+{
+  if (fep->engine == NULL)
+    return;
+
+  if (fep->engine->free)
+    fep->engine->free (fep->engine);
+  dlclose (fep->engine_module);
+  fep->engine = NULL;
+  fep->engine_module = NULL;
+  free (fep->engine_cursor_text);
+  fep->engine_cursor_text = NULL;
+  free (fep->engine_status_text);
+  fep->engine_status_text = NULL;
+}
+
+/* Render the text returned by GET_TEXT if it or its attribute differs
+   from what the engine returned last time, which is kept in LAST_TEXT
+   and LAST_ATTR; the clients may have drawn their own text since, so
+   it is not compared with what is on the screen.  */
+static void
+update_text (Fep          *fep,
+	     const char *(*get_text) (FepEngine *, FepAttribute *),
+	     char        **last_text,
+	     FepAttribute *last_attr,
+	     void        (*output) (Fep *, const char *, FepAttribute *))
+{
+  FepAttribute attr;
+  const char *text;
+
+  if (get_text == NULL)
+    return;
+
+  memset (&attr, 0, sizeof(FepAttribute));
+  attr.type = FEP_ATTR_TYPE_NONE;
+  text = get_text (fep->engine, &attr);
+  if (text == NULL)
+    text = "";
+  if (strcmp (text, *last_text ? *last_text : "") != 0
+      || memcmp (&attr, last_attr, sizeof(FepAttribute)) != 0)
+    {
+      free (*last_text);
+      *last_text = xstrdup (text);
+      memcpy (last_attr, &attr, sizeof(FepAttribute));
+      output (fep, text, &attr);
+    }
+}
+
+/* Pass EVENT to the engine, and render its cursor and status text if
+   they have changed.  Returns true if the engine has handled EVENT.  */
+bool
+_fep_engine_filter_event (Fep *fep, FepEvent *event)
+{
+  int retval;
+
+  if (fep->engine == NULL || fep->engine->filter_event == NULL)
+    return false;
+
+  _fep_output_hold (fep);
+  retval = fep->engine->filter_event (fep->engine, event);
+  update_text (fep, fep->engine->get_cursor_text,
+	       &fep->engine_cursor_text, &fep->engine_cursor_text_attr,
+	       _fep_output_cursor_text);
+  update_text (fep, fep->engine->get_status_text,
+	       &fep->engine_status_text, &fep->engine_status_text_attr,
+	       _fep_output_status_text);
+  _fep_output_release (fep);
+
+  return retval != 0;
+}
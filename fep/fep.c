@@ -47,6 +47,9 @@
 #include <errno.h>
 #include <assert.h>
 
+/* in milliseconds */
+#define FEP_DEFAULT_ESC_TIMEOUT 50
+
 static sigset_t orig_sigmask;
 static sig_atomic_t signals;
 
@@ -86,6 +89,8 @@ done (Fep *fep, int code)
   if (row < 0)
     putchar ('\n');
 
+  if (fep->kitty_keyboard)
+    _fep_output_kitty_keyboard (fep, false);
   tcsetattr (fep->tty_in, TCSAFLUSH, &fep->orig_termios);
   
   fep_free (fep);
@@ -170,6 +175,7 @@ handle_winch_signal (Fep *fep)
 {
   struct winsize _winsize;
   FepControlMessage request;
+  FepEventResize event;
   int i;
 
   memcpy (&_winsize, &fep->winsize, sizeof(struct winsize));
@@ -178,8 +184,12 @@ handle_winch_signal (Fep *fep)
   _fep_output_set_screen_size (fep, _winsize.ws_col, _winsize.ws_row);
   ioctl (fep->pty, TIOCSWINSZ, &fep->winsize);
 
-  request.command = FEP_CONTROL_RESIZE_EVENT;
-  _fep_control_message_alloc_args (&request, 2);
+  event.event.type = FEP_RESIZED;
+  event.cols = _winsize.ws_col;
+  event.rows = _winsize.ws_row;
+  _fep_engine_filter_event (fep, (FepEvent *) &event);
+
+  _fep_control_message_init (&request, FEP_CONTROL_RESIZE_EVENT);
   _fep_control_message_write_uint32_arg (&request,
 					 0,
 					 (uint32_t) _winsize.ws_col);
@@ -191,7 +201,7 @@ handle_winch_signal (Fep *fep)
       FepControlMessage response;
 
       if (_fep_transceive_control_message (fep,
-					   fep->clients[i],
+					   &fep->clients[i],
 					   &request,
 					   &response) == 0)
 	_fep_control_message_free_args (&response);
@@ -205,6 +215,8 @@ handle_tstp_signal (Fep *fep)
   struct sigaction act;
   sigset_t sigmask;
 
+  if (fep->kitty_keyboard)
+    _fep_output_kitty_keyboard (fep, false);
   tcsetattr (fep->tty_in, TCSAFLUSH, &fep->orig_termios);
 
   sigemptyset (&act.sa_mask);
@@ -225,6 +237,9 @@ handle_tstp_signal (Fep *fep)
   act.sa_handler = signal_handler;
   sigaction (SIGTSTP, &act, NULL);
   sigaction (SIGCONT, &act, NULL);
+
+  if (fep->kitty_keyboard)
+    _fep_output_kitty_keyboard (fep, true);
 }
 
 Fep *
@@ -238,11 +253,33 @@ fep_new (void)
   fep->pty = -1;
   fep->server = -1;
   for (i = 0; i < FEP_MAX_CLIENTS; i++)
-    fep->clients[i] = -1;
+    fep->clients[i].fd = -1;
   fep->status_text = xstrdup ("");
+  fep->esc_timeout = FEP_DEFAULT_ESC_TIMEOUT;
+  /* wanted_chars is computed on first use */
+  fep->subscription_serial = 1;
   return fep;
 }
 
+/* Set how long to wait for the rest of an escape sequence, after
+   which the bytes read so far are taken as separate keys, such as a
+   lone Escape.  If MSEC is 0, escape sequences split across reads are
+   not recognized.  */
+void
+fep_set_esc_timeout (Fep *fep, int msec)
+{
+  fep->esc_timeout = msec;
+}
+
+/* Make the terminal report keys with modifiers which have no legacy
+   encoding, such as Control-Return, using the progressive keyboard
+   enhancement protocol, if it supports that.  */
+void
+fep_set_kitty_keyboard (Fep *fep, int enable)
+{
+  fep->use_kitty_keyboard = enable;
+}
+
 int
 fep_run (Fep *fep, const char *command[])
 {
@@ -254,6 +291,7 @@ fep_run (Fep *fep, const char *command[])
 
   tcgetattr (fep->tty_in, &fep->orig_termios);
   setupterm (NULL, fep->tty_out, NULL);
+  _fep_key_table_init ();
   ioctl (fep->tty_in, TIOCGWINSZ, &fep->winsize);
   fep->winsize.ws_row--;
 
@@ -284,8 +322,10 @@ fep_run (Fep *fep, const char *command[])
 
       tcgetattr (fep->tty_in, &termios);
       cfmakeraw (&termios);
-      termios.c_cc[VMIN] = 0;
-      termios.c_cc[VTIME] = 3;
+      /* pselect tells when input is available, and the escape
+	 timeout is handled in main_loop, so a read never waits */
+      termios.c_cc[VMIN] = 1;
+      termios.c_cc[VTIME] = 0;
       tcsetattr (fep->tty_in, TCSANOW, &termios);
 
       _fep_get_sgr_codes (fep->sgr_codes);
@@ -294,6 +334,17 @@ fep_run (Fep *fep, const char *command[])
       if (_fep_output_get_cursor_position (fep, &fep->cursor))
 	fep->has_cpr = true;
 
+      if (fep->use_kitty_keyboard)
+	{
+	  uint32_t flags;
+
+	  if (_fep_output_query_kitty_keyboard (fep, &flags))
+	    {
+	      _fep_output_kitty_keyboard (fep, true);
+	      fep->kitty_keyboard = true;
+	    }
+	}
+
       set_signal_handler ();
       retval = main_loop (fep);
 
@@ -328,6 +379,427 @@ remove_padding (const char *str)
   return dest;
 }
 
+/* Send the key event REQUEST to the engine and then to the clients
+   in order of priority, until one of them handles it, and then notify
+   observers.  Returns true if the key is handled; otherwise the
+   caller passes it to the child process.  */
+static bool
+dispatch_key_event (Fep               *fep,
+		    FepControlMessage *request,
+		    uint32_t           keyval,
+		    uint32_t           state,
+		    fd_set            *fds)
+{
+  FepControlClient *clients[FEP_MAX_CLIENTS];
+  FepControlMessage notify;
+  FepEventKey event;
+  size_t i, j, n_clients = 0;
+  bool is_key_handled;
+
+  event.event.type = FEP_KEY_PRESS;
+  event.keyval = keyval;
+  event.modifiers = state;
+  event.source = request->args[2].str;
+  event.source_length = request->args[2].len;
+  is_key_handled = _fep_engine_filter_event (fep, (FepEvent *) &event);
+
+  /* stable sort, so that clients of the same priority are called in
+     the order of connection */
+  for (i = 0; i < fep->n_clients; i++)
+    {
+      FepControlClient *client = &fep->clients[i];
+
+      if (client->fd < 0
+	  || client->observer
+	  || !_fep_control_client_wants_key (client, keyval, state))
+	continue;
+      for (j = n_clients;
+	   j > 0 && clients[j - 1]->priority < client->priority;
+	   j--)
+	clients[j] = clients[j - 1];
+      clients[j] = client;
+      n_clients++;
+    }
+
+  for (i = 0; !is_key_handled && i < n_clients; i++)
+    {
+      FepControlMessage response;
+      uint32_t intval;
+
+      /* a client which failed to respond does not handle the key */
+      if (_fep_transceive_control_message (fep,
+					   clients[i],
+					   request,
+					   &response) == 0)
+	{
+	  is_key_handled = _fep_control_message_read_uint32_arg (&response,
+								 1,
+								 &intval) == 0
+	    && intval != 0;
+	  _fep_control_message_free_args (&response);
+	}
+      FD_CLR (clients[i]->fd, fds);
+      if (clients[i]->shm)
+	FD_CLR (_fep_shm_get_poll_fd (clients[i]->shm), fds);
+    }
+
+  /* observers get the same arguments without having to respond */
+  notify.command = FEP_CONTROL_KEY_NOTIFY;
+  notify.args = request->args;
+  notify.n_args = request->n_args;
+  for (i = 0; i < fep->n_clients; i++)
+    {
+      FepControlClient *client = &fep->clients[i];
+
+      /* a closed observer is replaced by the next one in the array */
+      if (client->fd >= 0
+	  && client->observer
+	  && _fep_control_client_wants_key (client, keyval, state)
+	  && _fep_notify_control_client (fep, client, &notify) < 0)
+	i--;
+    }
+
+  return is_key_handled;
+}
+
+/* Whether no client is connected, nothing is drawn over the output of
+   the child process, and no key needs translation, in which case the
+   input and output are forwarded as is.  */
+static bool
+is_passthrough (Fep *fep)
+{
+  return fep->n_clients == 0
+    && fep->engine == NULL
+    && !fep->kitty_keyboard
+    && (fep->cursor_text == NULL || *fep->cursor_text == '\0')
+    && *fep->status_text == '\0';
+}
+
+/* Mark in fep->wanted_chars the printable characters whose key events
+   the engine or any client may want, and return true if there are
+   other ones, which can be passed to the child process without a key
+   event.  The result is only recomputed when subscription_serial has
+   changed.  */
+static bool
+get_wanted_chars (Fep *fep)
+{
+  uint32_t *wanted = fep->wanted_chars;
+  size_t i;
+  char c;
+
+  if (fep->wanted_serial == fep->subscription_serial)
+    return fep->wanted_passthrough;
+  fep->wanted_serial = fep->subscription_serial;
+
+  memset (wanted, 0, 4 * sizeof(uint32_t));
+  if (fep->engine)
+    {
+      memset (wanted, 0xff, 4 * sizeof(uint32_t));
+      fep->wanted_passthrough = false;
+      return false;
+    }
+
+  for (i = 0; i < fep->n_clients; i++)
+    {
+      FepControlClient *client = &fep->clients[i];
+
+      if (client->fd < 0)
+	continue;
+
+      for (c = 0x20; c < 0x7f; c++)
+	{
+	  uint32_t keyval, state;
+
+	  _fep_char_to_key (c, &keyval, &state);
+	  if (_fep_control_client_wants_key (client, keyval, state))
+	    wanted[c >> 5] |= 1U << (c & 31);
+	}
+    }
+
+  /* 0x7f is not printable */
+  fep->wanted_passthrough = wanted[1] != 0xffffffff
+    || wanted[2] != 0xffffffff
+    || (wanted[3] | 0x80000000) != 0xffffffff;
+  return fep->wanted_passthrough;
+}
+
+/* Notify the clients subscribing to mouse events of EVENT.  Unlike
+   key events, the report is passed to the child process anyway, so
+   there is no response to wait for.  */
+static void
+notify_mouse_event (Fep *fep, const FepEventMouse *event)
+{
+  FepControlMessage message;
+  bool initialized = false;
+  size_t i;
+
+  for (i = 0; i < fep->n_clients; i++)
+    {
+      FepControlClient *client = &fep->clients[i];
+
+      if (client->fd < 0
+	  || !client->key_subscribed
+	  || !(client->key_flags & FEP_KEY_SUBSCRIBE_MOUSE))
+	continue;
+
+      if (!initialized)
+	{
+	  _fep_control_message_init (&message, FEP_CONTROL_MOUSE_EVENT);
+	  _fep_control_message_write_uint32_arg (&message,
+						 0,
+						 (event->action << 8)
+						 | event->button);
+	  _fep_control_message_write_uint32_arg (&message,
+						 1,
+						 event->modifiers);
+	  _fep_control_message_write_uint32_arg (&message, 2, event->col);
+	  _fep_control_message_write_uint32_arg (&message, 3, event->row);
+	  initialized = true;
+	}
+      /* a closed client is replaced by the next one in the array */
+      if (_fep_notify_control_client (fep, client, &message) < 0)
+	i--;
+    }
+
+  if (initialized)
+    _fep_control_message_free_args (&message);
+}
+
+/* Mouse reports read by dispatch_tty_input and not yet passed on.
+   They are written to the child process at once, and of the motion
+   events among them, only the last one is sent to the clients.  */
+struct MouseBatch
+{
+  const char *start;
+  size_t length;
+  FepEventMouse motion;
+  bool has_motion;
+};
+
+static void
+flush_mouse_batch (Fep *fep, struct MouseBatch *batch)
+{
+  if (batch->has_motion)
+    {
+      notify_mouse_event (fep, &batch->motion);
+      batch->has_motion = false;
+    }
+  if (batch->length > 0)
+    {
+      write (fep->pty, batch->start, batch->length);
+      batch->length = 0;
+    }
+}
+
+/* Whether to wait for the rest of the incomplete escape sequence at
+   the end of the tty input, rather than taking it as separate keys.  */
+static bool
+hold_escape_sequence (Fep *fep)
+{
+  uint32_t now;
+
+  if (fep->esc_timeout <= 0)
+    return false;
+
+  now = _fep_get_monotonic_time ();
+  if (!fep->esc_pending)
+    {
+      fep->esc_pending = true;
+      fep->esc_deadline = now + fep->esc_timeout * 1000;
+      return true;
+    }
+  return (int32_t) (fep->esc_deadline - now) > 0;
+}
+
+/* Send key events for the input BUF read from the tty, and pass the
+   keys nobody handles, as well as mouse reports, to the child process.
+   Returns the number of bytes processed, which is less than LEN if an
+   incomplete escape sequence is held or continues past LEN.  */
+static size_t
+dispatch_tty_input (Fep *fep, char *buf, size_t len, fd_set *fds)
+{
+  const uint32_t *wanted = fep->wanted_chars;
+  struct MouseBatch batch;
+  bool passthrough;
+  size_t i, run_end = 0;
+
+  memset (&batch, 0, sizeof(batch));
+  passthrough = get_wanted_chars (fep);
+  for (i = 0; i < len; )
+    {
+      uint32_t keyval;
+      uint32_t state;
+      FepEventMouse mouse;
+      FepCSI *csi;
+      char *endptr;
+      bool is_key_read, is_key_handled;
+
+      if (_fep_esc_is_incomplete (buf + i, len - i))
+	{
+	  /* the rest of the sequence is in fep->ttybuf beyond BUF, so
+	     leave it there for the next pass; unless the sequence
+	     fills BUF, which is not a key anyway */
+	  if (len < _fep_ring_length (&fep->ttybuf) && i > 0)
+	    {
+	      flush_mouse_batch (fep, &batch);
+	      fep->esc_pending = false;
+	      return i;
+	    }
+	  /* the rest can only follow in a later read */
+	  if (len == _fep_ring_length (&fep->ttybuf)
+	      && hold_escape_sequence (fep))
+	    {
+	      flush_mouse_batch (fep, &batch);
+	      return i;
+	    }
+	}
+
+      if (_fep_esc_to_mouse (buf + i, len - i, &mouse, &endptr))
+	{
+	  if (batch.length == 0)
+	    batch.start = buf + i;
+	  batch.length += endptr - (buf + i);
+	  if (mouse.action == FEP_MOUSE_MOTION)
+	    {
+	      batch.motion = mouse;
+	      batch.has_motion = true;
+	    }
+	  else
+	    {
+	      /* keep the order of motion and clicks */
+	      if (batch.has_motion)
+		{
+		  notify_mouse_event (fep, &batch.motion);
+		  batch.has_motion = false;
+		}
+	      notify_mouse_event (fep, &mouse);
+	    }
+	  i += endptr - (buf + i);
+	  continue;
+	}
+      flush_mouse_batch (fep, &batch);
+
+      /* write a run of printable characters nobody wants at once,
+	 instead of making a key event for each */
+      if (passthrough)
+	{
+	  size_t j;
+
+	  /* a wanted character may have cut the previous run short,
+	     and the rest of it is known to be printable */
+	  if (run_end <= i)
+	    run_end = i + _fep_scan_printable (buf + i, len - i);
+	  for (j = i; j < run_end; j++)
+	    {
+	      unsigned char c = buf[j];
+	      if (wanted[c >> 5] & (1U << (c & 31)))
+		break;
+	    }
+	  if (j > i)
+	    {
+	      write (fep->pty, buf + i, j - i);
+	      i = j;
+	      continue;
+	    }
+	}
+
+      /* a CSI sequence is parsed once for both of the checks below */
+      csi = _fep_csi_parse (buf + i, len - i, '\133', &endptr);
+
+      /* a cursor position report the child has asked for, or one
+	 which came too late for _fep_output_dsr_cpr, is not a key */
+      if (csi && _fep_csi_is_cpr (csi))
+	{
+	  _fep_csi_free (csi);
+	  write (fep->pty, buf + i, endptr - (buf + i));
+	  i += endptr - (buf + i);
+	  continue;
+	}
+
+      if (csi)
+	{
+	  is_key_read = _fep_csi_to_key (csi, &keyval, &state);
+	  _fep_csi_free (csi);
+	}
+      else
+	is_key_read = _fep_esc_to_key (buf + i, len - i,
+				       &keyval, &state, &endptr);
+      if (!is_key_read)
+	{
+	  is_key_read = _fep_char_to_key (buf[i], &keyval, &state);
+
+	  /* proceed to the next char regardless of is_key_read */
+	  endptr = buf + i + 1;
+	}
+
+      is_key_handled = false;
+      if (is_key_read)
+	{
+	  FepControlMessage request;
+
+	  _fep_control_message_init (&request, FEP_CONTROL_KEY_EVENT);
+	  _fep_control_message_write_uint32_arg (&request,
+						 0,
+						 (uint32_t) keyval);
+	  _fep_control_message_write_uint32_arg (&request,
+						 1,
+						 (uint32_t) state);
+	  _fep_control_message_write_string_arg (&request,
+						 2,
+						 buf + i,
+						 endptr - (buf + i));
+	  _fep_control_message_write_uint32_arg (&request,
+						 3,
+						 _fep_get_monotonic_time ());
+	  is_key_handled = dispatch_key_event (fep, &request,
+					       keyval, state, fds);
+	  _fep_control_message_free_args (&request);
+	  /* the clients may have changed their subscriptions */
+	  passthrough = get_wanted_chars (fep);
+	}
+      if (!is_key_handled)
+	{
+	  /* the child expects the legacy sequence, and a key without
+	     one is dropped rather than sent in the CSI u form */
+	  if (fep->kitty_keyboard && is_key_read
+	      && endptr - (buf + i) > 2 && endptr[-1] == 'u')
+	    {
+	      size_t length;
+	      char *data = _fep_key_to_string (keyval, state, &length);
+
+	      if (data)
+		{
+		  write (fep->pty, data, length);
+		  free (data);
+		}
+	    }
+	  else
+	    write (fep->pty, buf + i, endptr - (buf + i));
+	}
+      i += endptr - (buf + i);
+    }
+  flush_mouse_batch (fep, &batch);
+  fep->esc_pending = false;
+  return len;
+}
+
+/* Process the input in fep->ttybuf, using BUF as scratch space.  */
+static void
+process_tty_input (Fep *fep, char *buf, size_t size, fd_set *fds)
+{
+  size_t len = _fep_ring_peek (&fep->ttybuf, buf, size - 1);
+
+  buf[len] = '\0';
+  if (is_passthrough (fep))
+    {
+      write (fep->pty, buf, len);
+      fep->esc_pending = false;
+    }
+  else
+    len = dispatch_tty_input (fep, buf, len, fds);
+  _fep_ring_consume (&fep->ttybuf, len);
+}
+
 static int
 main_loop (Fep *fep)
 {
@@ -356,15 +828,17 @@ main_loop (Fep *fep)
 	      signals &= ~FEP_SIG_FLAG_TSTP;
 	      handle_tstp_signal (fep);
 	    }
+	  /* the escape timeout may have expired */
+	  if (fep->esc_pending)
+	    process_tty_input (fep, buf, sizeof(buf), &fds);
 	  continue;
 	}
 
       if (FD_ISSET(fep->tty_in, &fds))
 	{
-	  ssize_t bytes_read, i;
+	  ssize_t bytes_read;
 
-	  memset (buf, 0, sizeof(buf));
-	  bytes_read = _fep_read (fep, buf, sizeof(buf) - 1);
+	  bytes_read = _fep_read (fep);
 	  if (bytes_read < 0)
 	    {
 	      fprintf (stderr, "Can't read from tty: %s\n",
@@ -375,64 +849,7 @@ main_loop (Fep *fep)
 	  if (bytes_read == 0)
 	    break;
 
-	  buf[bytes_read] = '\0';
-
-	  for (i = 0; i < bytes_read; )
-	    {
-	      uint32_t keyval;
-	      uint32_t state;
-	      char *endptr;
-	      bool is_key_read, is_key_handled;
-
-	      is_key_read = _fep_esc_to_key (buf + i, bytes_read - i,
-					     &keyval, &state, &endptr);
-	      if (!is_key_read)
-		{
-		  is_key_read = _fep_char_to_key (buf[i], &keyval, &state);
-
-		  /* proceed to the next char regardless of is_key_read */
-		  endptr = buf + i + 1;
-		}
-
-	      is_key_handled = false;
-	      if (is_key_read)
-		{
-		  FepControlMessage request;
-		  int j;
-
-		  request.command = FEP_CONTROL_KEY_EVENT;
-		  _fep_control_message_alloc_args (&request, 3);
-		  _fep_control_message_write_uint32_arg (&request,
-							 0,
-							 (uint32_t) keyval);
-		  _fep_control_message_write_uint32_arg (&request,
-							 1,
-							 (uint32_t) state);
-		  _fep_control_message_write_string_arg (&request,
-							 2,
-							 buf + i,
-							 endptr - (buf + i));
-		  for (j = 0; j < fep->n_clients; j++)
-		    {
-		      FepControlMessage response;
-		      if (fep->clients[j] < 0)
-			continue;
-		      if (_fep_transceive_control_message (fep,
-							   fep->clients[j],
-							   &request,
-							   &response) == 0)
-			{
-			  is_key_handled = true;
-			  _fep_control_message_free_args (&response);
-			}
-		      FD_CLR (fep->clients[j], &fds);
-		    }
-		  _fep_control_message_free_args (&request);
-		}
-	      if (!is_key_handled)
-		write (fep->pty, buf + i, endptr - (buf + i));
-	      i += endptr - (buf + i);
-	    }
+	  process_tty_input (fep, buf, sizeof(buf), &fds);
 	}
 
       /* input from pty (child process) */
@@ -451,47 +868,90 @@ main_loop (Fep *fep)
 	  fep_log (FEP_LOG_LEVEL_DEBUG,
 		   "pty read \"%s\"", buf);
 
-	  str1 = find_match_end (buf,
-				 bytes_read,
-				 clear_screen,
-				 strlen (clear_screen));
-	  str2 = find_match_end (buf,
-				 bytes_read,
-				 clr_eos,
-				 strlen (clr_eos));
-	  if (str1 != NULL || str2 != NULL)
+	  /* nothing to redraw when the screen is cleared */
+	  if (is_passthrough (fep))
+	    _fep_output_string_from_pty_direct (fep, buf, bytes_read);
+	  else
 	    {
-	      int str1_len;
-	      if (str2 > str1)
-		str1 = str2;
-	      str1_len = bytes_read - (str1 - buf);
-	      _fep_output_string_from_pty (fep, buf, bytes_read - str1_len);
-	      _fep_output_status_text (fep,
-				       fep->status_text,
-				       &fep->status_text_attr);
-	      _fep_output_string_from_pty (fep, str1, str1_len);
+	      str1 = find_match_end (buf,
+				     bytes_read,
+				     clear_screen,
+				     strlen (clear_screen));
+	      str2 = find_match_end (buf,
+				     bytes_read,
+				     clr_eos,
+				     strlen (clr_eos));
+	      if (str1 != NULL || str2 != NULL)
+		{
+		  int str1_len;
+		  if (str2 > str1)
+		    str1 = str2;
+		  str1_len = bytes_read - (str1 - buf);
+		  _fep_output_string_from_pty (fep,
+					       buf,
+					       bytes_read - str1_len);
+		  _fep_output_status_text (fep,
+					   fep->status_text,
+					   &fep->status_text_attr);
+		  _fep_output_string_from_pty (fep, str1, str1_len);
+		}
+	      else
+		_fep_output_string_from_pty (fep, buf, bytes_read);
 	    }
-	  else
-	    _fep_output_string_from_pty (fep, buf, bytes_read);
 	}
       /* accept client connection via control socket */
       if (FD_ISSET(fep->server, &fds))
 	{
 	  int fd = accept (fep->server, NULL, NULL);
 	  if (fd >= 0)
-	    fep->clients[fep->n_clients++] = fd;
+	    {
+	      if (fep->n_clients < FEP_MAX_CLIENTS)
+		{
+		  FepControlClient *client = &fep->clients[fep->n_clients];
+
+		  memset (client, 0, sizeof(FepControlClient));
+		  client->fd = fd;
+		  fep->n_clients++;
+		  fep->subscription_serial++;
+		}
+	      else
+		close (fd);
+	    }
 	}
       /* input from control socket */
       for (i = 0; i < fep->n_clients; i++)
 	{
-	  if (fep->clients[i] >= 0 && FD_ISSET(fep->clients[i], &fds))
+	  FepControlClient *client = &fep->clients[i];
+
+	  if (client->fd < 0)
+	    continue;
+
+	  /* with the shared memory transport, the control socket is
+	     only readable when the client hangs up */
+	  if (client->shm && FD_ISSET(client->fd, &fds))
 	    {
 	      FepControlMessage message;
-	      if (_fep_read_control_message_from_fd (fep,
-						     fep->clients[i],
-						     &message) == 0)
+
+	      /* dispatch what was left in the ring before the hangup */
+	      while (_fep_shm_read_control_message (client->shm,
+						    &message,
+						    false) == 0)
 		{
-		  _fep_dispatch_control_message (fep, &message);
+		  _fep_dispatch_control_message (fep, client, &message);
+		  _fep_control_message_free_args (&message);
+		}
+	      _fep_close_control_client (fep, client);
+	    }
+	  else if (FD_ISSET(client->fd, &fds)
+		   || (client->shm
+		       && FD_ISSET(_fep_shm_get_poll_fd (client->shm), &fds)))
+	    {
+	      FepControlMessage message;
+	      if (_fep_read_control_message_from_client (fep,
+							 client,
+							 &message) == 0)
+		{
+		  _fep_dispatch_control_message (fep, client, &message);
 		  _fep_control_message_free_args (&message);
 		}
 	    }
@@ -506,20 +966,21 @@ main_loop (Fep *fep)
 void
 fep_free (Fep *fep)
 {
-  int i;
-
   reset_signal_handler ();
 
   if (fep->pty >= 0)
     close (fep->pty);
 
-  for (i = 0; i < fep->n_clients; i++)
-    if (fep->clients[i] >= 0)
-      close (fep->clients[i]);
+  while (fep->n_clients > 0)
+    _fep_close_control_client (fep, &fep->clients[0]);
+
+  _fep_unload_engine (fep);
 
   _fep_close_control_socket (fep);
 
   free (fep->cursor_text);
   free (fep->status_text);
+  free (fep->outbuf.str);
+  _fep_ring_free (&fep->ttybuf);
   free (fep);
 }
@@ -22,6 +22,9 @@
 typedef struct _Fep Fep;
 
 Fep *fep_new (void);
+int fep_load_engine (Fep *fep, const char *path, const char *args);
+void fep_set_esc_timeout (Fep *fep, int msec);
+void fep_set_kitty_keyboard (Fep *fep, int enable);
 int fep_run (Fep *fep, const char *command[]);
 void fep_free (Fep *fep);
 
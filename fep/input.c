@@ -35,21 +35,132 @@
 */
 
 #include "private.h"
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <assert.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined __GNUC__ && defined __x86_64__
+#include <immintrin.h>
+#define HAVE_SCAN_PRINTABLE_AVX2 1
+#endif
+
+static void
+ring_reserve (FepRing *ring, size_t count)
+{
+  size_t len = ring->tail - ring->head;
+  size_t cap;
+  char *data;
+
+  if (len + count <= ring->cap)
+    return;
+
+  for (cap = MAX(ring->cap, 256); cap < len + count; cap *= 2)
+    ;
+  data = xmalloc (cap);
+  _fep_ring_peek (ring, data, len);
+  free (ring->data);
+  ring->data = data;
+  ring->cap = cap;
+  ring->head = 0;
+  ring->tail = len;
+}
+
+void
+_fep_ring_write (FepRing *ring, const char *data, size_t count)
+{
+  size_t offset, n;
+
+  ring_reserve (ring, count);
+  offset = ring->tail & (ring->cap - 1);
+  n = MIN(count, ring->cap - offset);
+  memcpy (ring->data + offset, data, n);
+  memcpy (ring->data, data + n, count - n);
+  ring->tail += count;
+}
+
+/* Read at most COUNT bytes from FD at the end of RING, without an
+   intermediate buffer.  */
 ssize_t
-_fep_read (Fep *fep, void *buf, size_t count)
+_fep_ring_read (FepRing *ring, int fd, size_t count)
 {
-  if (fep->ttybuf.len > 0)
-    {
-      size_t _count = MIN(count, fep->ttybuf.len);
-      memcpy (buf, fep->ttybuf.str, _count);
-      fep->ttybuf.len -= _count;
-      memmove (fep->ttybuf.str, fep->ttybuf.str + _count, fep->ttybuf.len);
-      return count;
-    }
-  return read (fep->tty_in, buf, count);
+  struct iovec iov[2];
+  size_t offset;
+  ssize_t bytes_read;
+
+  ring_reserve (ring, count);
+  offset = ring->tail & (ring->cap - 1);
+  iov[0].iov_base = ring->data + offset;
+  iov[0].iov_len = MIN(count, ring->cap - offset);
+  iov[1].iov_base = ring->data;
+  iov[1].iov_len = count - iov[0].iov_len;
+  bytes_read = readv (fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+  if (bytes_read > 0)
+    ring->tail += bytes_read;
+  return bytes_read;
+}
+
+/* Copy at most COUNT bytes from the beginning of RING to BUF, without
+   removing them.  Returns the number of bytes copied.  */
+size_t
+_fep_ring_peek (const FepRing *ring, char *buf, size_t count)
+{
+  size_t offset, n;
+
+  count = MIN(count, ring->tail - ring->head);
+  if (count == 0)
+    return 0;
+
+  offset = ring->head & (ring->cap - 1);
+  n = MIN(count, ring->cap - offset);
+  memcpy (buf, ring->data + offset, n);
+  memcpy (buf + n, ring->data, count - n);
+  return count;
+}
+
+void
+_fep_ring_consume (FepRing *ring, size_t count)
+{
+  assert (count <= ring->tail - ring->head);
+  ring->head += count;
+  /* keep the data contiguous as long as possible */
+  if (ring->head == ring->tail)
+    ring->head = ring->tail = 0;
+}
+
+size_t
+_fep_ring_length (const FepRing *ring)
+{
+  return ring->tail - ring->head;
+}
+
+void
+_fep_ring_free (FepRing *ring)
+{
+  free (ring->data);
+  memset (ring, 0, sizeof(FepRing));
+}
+
+/* Read input from the tty into fep->ttybuf, unless it already holds
+   input to be processed, other than an incomplete escape sequence.
+   Returns the number of bytes available, 0 at end of file, or -1 on
+   error.  */
+ssize_t
+_fep_read (Fep *fep)
+{
+  ssize_t bytes_read;
+
+  if (_fep_ring_length (&fep->ttybuf) > 0 && !fep->esc_pending)
+    return _fep_ring_length (&fep->ttybuf);
+
+  bytes_read = _fep_ring_read (&fep->ttybuf, fep->tty_in, BUFSIZ);
+  if (bytes_read <= 0)
+    return bytes_read;
+  return _fep_ring_length (&fep->ttybuf);
 }
 
 int
@@ -57,13 +168,14 @@ _fep_pselect (Fep *fep, fd_set *fds, sigset_t *sigmask)
 {
   FD_ZERO(fds);
 
-  if (fep->ttybuf.len > 0)
+  if (_fep_ring_length (&fep->ttybuf) > 0 && !fep->esc_pending)
     {
       FD_SET(fep->tty_in, fds);
       return 1;
     }
   else
     {
+      struct timespec timeout, *timeoutp = NULL;
       int nfds = 0, i;
       FD_SET(fep->tty_in, fds);
       nfds = MAX(nfds, fep->tty_in);
@@ -72,11 +184,111 @@ _fep_pselect (Fep *fep, fd_set *fds, sigset_t *sigmask)
       FD_SET(fep->server, fds);
       nfds = MAX(nfds, fep->server);
       for (i = 0; i < fep->n_clients; i++)
-	if (fep->clients[i] >= 0)
+	if (fep->clients[i].fd >= 0)
 	  {
-	    FD_SET(fep->clients[i], fds);
-	    nfds = MAX(nfds, fep->clients[i]);
+	    FD_SET(fep->clients[i].fd, fds);
+	    nfds = MAX(nfds, fep->clients[i].fd);
+	    if (fep->clients[i].shm)
+	      {
+		int fd = _fep_shm_get_poll_fd (fep->clients[i].shm);
+		FD_SET(fd, fds);
+		nfds = MAX(nfds, fd);
+	      }
 	  }
-      return pselect (nfds + 1, fds, NULL, NULL, NULL, sigmask);
+
+      /* wake up when the incomplete escape sequence expires, which
+	 main_loop notices when this returns 0 */
+      if (fep->esc_pending)
+	{
+	  int32_t remaining = fep->esc_deadline - _fep_get_monotonic_time ();
+
+	  remaining = MAX(remaining, 0);
+	  timeout.tv_sec = remaining / 1000000;
+	  timeout.tv_nsec = (remaining % 1000000) * 1000;
+	  timeoutp = &timeout;
+	}
+      return pselect (nfds + 1, fds, NULL, NULL, timeoutp, sigmask);
+    }
+}
+
+static size_t
+scan_printable_scalar (const char *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned char c = buf[i];
+      if (c < 0x20 || c > 0x7e)
+	break;
+    }
+  return i;
+}
+
+#ifdef __SSE2__
+/* A byte is printable if it is greater than 0x1f and less than 0x7f
+   as a signed char; the bytes from 0x80 are negative.  */
+static size_t
+scan_printable_sse2 (const char *buf, size_t len)
+{
+  const __m128i lower = _mm_set1_epi8 (0x1f);
+  const __m128i upper = _mm_set1_epi8 (0x7f);
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (buf + i));
+      __m128i printable = _mm_and_si128 (_mm_cmpgt_epi8 (v, lower),
+					 _mm_cmplt_epi8 (v, upper));
+      unsigned int mask = _mm_movemask_epi8 (printable);
+      if (mask != 0xffff)
+	return i + __builtin_ctz (~mask);
+    }
+  return i + scan_printable_scalar (buf + i, len - i);
+}
+#endif
+
+#ifdef HAVE_SCAN_PRINTABLE_AVX2
+__attribute__ ((target ("avx2")))
+static size_t
+scan_printable_avx2 (const char *buf, size_t len)
+{
+  const __m256i lower = _mm256_set1_epi8 (0x1f);
+  const __m256i upper = _mm256_set1_epi8 (0x7f);
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (buf + i));
+      __m256i printable = _mm256_and_si256 (_mm256_cmpgt_epi8 (v, lower),
+					    _mm256_cmpgt_epi8 (upper, v));
+      unsigned int mask = _mm256_movemask_epi8 (printable);
+      if (mask != 0xffffffff)
+	return i + __builtin_ctz (~mask);
+    }
+  return i + scan_printable_sse2 (buf + i, len - i);
+}
+#endif
+
+/* Return the length of the run of printable ASCII characters at the
+   beginning of BUF.  */
+size_t
+_fep_scan_printable (const char *buf, size_t len)
+{
+  static size_t (*scan) (const char *, size_t);
+
+  if (scan == NULL)
+    {
+#ifdef HAVE_SCAN_PRINTABLE_AVX2
+      if (__builtin_cpu_supports ("avx2"))
+	scan = scan_printable_avx2;
+      else
+#endif
+#ifdef __SSE2__
+	scan = scan_printable_sse2;
+#else
+	scan = scan_printable_scalar;
+#endif
     }
+  return scan (buf, len);
 }
@@ -38,16 +38,26 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include "striconv.h"
+#include <langinfo.h>
 #include <errno.h>
 #include <assert.h>
 
-struct CursorStateEntry
+/* The modifier parameter of xterm and CSI u key sequences is one
+   plus the sum of these bits.  */
+struct ModifierBitEntry
 {
-  int param;
+  int bit;
   FepModifierType state;
-} cursor_states[] = {
-  { 2, FEP_SHIFT_MASK },
-  { 5, FEP_CONTROL_MASK },
+} modifier_bits[] = {
+  { 1, FEP_SHIFT_MASK },
+  { 2, FEP_MOD1_MASK },		/* Alt */
+  { 4, FEP_CONTROL_MASK },
+  { 8, FEP_SUPER_MASK },
+  { 16, FEP_HYPER_MASK },
+  { 32, FEP_META_MASK },
+  { 64, FEP_LOCK_MASK },	/* Caps Lock */
+  { 128, FEP_MOD2_MASK },	/* Num Lock */
 };
 
 struct CursorKeyvalEntry
@@ -62,8 +72,75 @@ struct CursorKeyvalEntry
     { 'D', FEP_Left },
     { 'F', FEP_End },
     { 'H', FEP_Home },
+    { 'P', FEP_F1 },
+    { 'Q', FEP_F2 },
+    { 'R', FEP_F3 },
+    { 'S', FEP_F4 },
   };
 
+/* keys sent as CSI NUMBER ~ */
+struct TildeKeyvalEntry
+{
+  int number;
+  uint32_t keyval;
+} tilde_keyvals[] =
+  {
+    { 2, FEP_Insert },
+    { 3, FEP_Delete },
+    { 5, FEP_Prior },
+    { 6, FEP_Next },
+    { 7, FEP_Home },
+    { 8, FEP_End },
+    { 11, FEP_F1 },
+    { 12, FEP_F2 },
+    { 13, FEP_F3 },
+    { 14, FEP_F4 },
+    { 15, FEP_F5 },
+    { 17, FEP_F6 },
+    { 18, FEP_F7 },
+    { 19, FEP_F8 },
+    { 20, FEP_F9 },
+    { 21, FEP_F10 },
+    { 23, FEP_F11 },
+    { 24, FEP_F12 },
+  };
+
+/* keys with a code other than their character in CSI u sequences */
+struct CodeKeyvalEntry
+{
+  int code;
+  uint32_t keyval;
+} code_keyvals[] =
+  {
+    { 9, FEP_Tab },
+    { 13, FEP_Return },
+    { 27, FEP_Escape },
+    { 127, FEP_BackSpace },
+  };
+
+static uint32_t
+modifier_param_to_state (int param)
+{
+  uint32_t state = 0;
+  int i;
+
+  for (i = 0; i < SIZEOF (modifier_bits); i++)
+    if ((param - 1) & modifier_bits[i].bit)
+      state |= modifier_bits[i].state;
+  return state;
+}
+
+static int
+state_to_modifier_param (uint32_t state)
+{
+  int param = 1, i;
+
+  for (i = 0; i < SIZEOF (modifier_bits); i++)
+    if (state & modifier_bits[i].state)
+      param += modifier_bits[i].bit;
+  return param;
+}
+
 struct CapKeyvalEntry
 {
   char *name;
@@ -154,19 +231,70 @@ _fep_char_to_key (char      tty,
   return key != 0;
 }
 
-char *
-_fep_key_to_string (uint32_t key,
-                    uint32_t state,
-                    size_t  *r_length)
+/* Return the text of KEY, a Latin-1 or Unicode keyval, in the locale
+   encoding as _fep_output_send_text sends it, or NULL if KEY is not
+   such a keyval.  */
+static char *
+key_to_text (uint32_t key)
+{
+  uint32_t uc;
+  char utf8[5];
+  size_t len;
+
+  if (key >= 0xa0 && key < 0x100)
+    uc = key;
+  else if ((key & 0xff000000) == 0x01000000
+	   && (key & 0x00ffffff) >= 0xa0
+	   && (key & 0x00ffffff) <= 0x10ffff)
+    uc = key & 0x00ffffff;
+  else
+    return NULL;
+
+  if (uc < 0x800)
+    {
+      utf8[0] = 0xc0 | (uc >> 6);
+      utf8[1] = 0x80 | (uc & 0x3f);
+      len = 2;
+    }
+  else if (uc < 0x10000)
+    {
+      utf8[0] = 0xe0 | (uc >> 12);
+      utf8[1] = 0x80 | ((uc >> 6) & 0x3f);
+      utf8[2] = 0x80 | (uc & 0x3f);
+      len = 3;
+    }
+  else
+    {
+      utf8[0] = 0xf0 | (uc >> 18);
+      utf8[1] = 0x80 | ((uc >> 12) & 0x3f);
+      utf8[2] = 0x80 | ((uc >> 6) & 0x3f);
+      utf8[3] = 0x80 | (uc & 0x3f);
+      len = 4;
+    }
+  utf8[len] = '\0';
+
+  return str_iconv (utf8, "UTF-8", nl_langinfo (CODESET));
+}
+
+/* Return the sequence the terminal sends for KEY with modifiers
+   STATE, or NULL if there is none.  */
+static char *
+encode_key (uint32_t key, uint32_t state, size_t *r_length)
 {
   FepCSI csi;
   FepString str;
   char *p;
-  int i;
+  int i, param;
+  /* Alt is sent as an ESC prefix, except in the parameters of a
+     sequence */
+  bool esc_prefix = (state & FEP_MOD1_MASK) != 0;
 
   memset (&csi, 0, sizeof (csi));
   memset (&str, 0, sizeof (str));
 
+  /* lock modifiers don't change the legacy sequences */
+  param = state_to_modifier_param (state & ~(FEP_LOCK_MASK | FEP_MOD2_MASK));
+
   switch (key)
     {
       /* cursor */
@@ -174,7 +302,6 @@ _fep_key_to_string (uint32_t key,
     case FEP_Up:
     case FEP_Right:
     case FEP_Down:
-    case FEP_Delete:
     case FEP_Home:
     case FEP_End:
       for (i = 0; i < SIZEOF (cursor_keyvals); i++)
@@ -184,18 +311,15 @@ _fep_key_to_string (uint32_t key,
 	    break;
 	  }
       csi.params = "";
-      for (i = 0; i < SIZEOF (cursor_states); i++)
-	if (cursor_states[i].state & state)
-	  {
-	    csi.params = xasprintf ("0;%d", cursor_states[i].param);
-	    break;
-	  }
+      if (param > 1)
+	csi.params = xasprintf ("1;%d", param);
       csi.intermediate = "";
       p = _fep_csi_format (&csi);
       _fep_string_append (&str, p, strlen (p));
       free (p);
       if (*csi.params != '\0')
 	free (csi.params);
+      esc_prefix = false;
       break;
 
       /* tty */
@@ -224,11 +348,6 @@ _fep_key_to_string (uint32_t key,
 	    _fep_string_append_c (&str, key - ('a' - 1));
 	  else if (key >= '\\' && key <= '_')
 	    _fep_string_append_c (&str, key - ('A' - 1));
-	  else
-	    fep_log (FEP_LOG_LEVEL_WARNING,
-		     "no tty sequence for key %u modifiers %u",
-		     key,
-		     state);
 	}
       else if (state & FEP_SHIFT_MASK)
 	{
@@ -236,15 +355,40 @@ _fep_key_to_string (uint32_t key,
 	    _fep_string_append_c (&str, 'A' + (key - 'a'));
 	  else if (key >= 0x21 && key <= 0x7E)
 	    _fep_string_append_c (&str, key);
-	  else
-	    fep_log (FEP_LOG_LEVEL_WARNING,
-		     "no tty sequence for key %u modifiers %u",
-		     key,
-		     state);
 	}
       else if (key >= 0x21 && key <= 0x7E)
 	_fep_string_append_c (&str, key);
 
+      /* modified F1-F4 are sent as CSI 1;PARAM P-S, as xterm does,
+	 rather than in the CSI 11~ form of tilde_keyvals */
+      if (str.len == 0 && param > 1 && key >= FEP_F1 && key <= FEP_F4)
+	for (i = 0; i < SIZEOF (cursor_keyvals); i++)
+	  if (cursor_keyvals[i].keyval == key)
+	    {
+	      p = xasprintf ("\033\1331;%d%c",
+			     param,
+			     cursor_keyvals[i].final);
+	      _fep_string_append (&str, p, strlen (p));
+	      free (p);
+	      esc_prefix = false;
+	      break;
+	    }
+
+      if (str.len == 0 && param > 1)
+	{
+	  for (i = 0; i < SIZEOF (tilde_keyvals); i++)
+	    if (tilde_keyvals[i].keyval == key)
+	      {
+		p = xasprintf ("\033\133%d;%d~",
+			       tilde_keyvals[i].number,
+			       param);
+		_fep_string_append (&str, p, strlen (p));
+		free (p);
+		esc_prefix = false;
+		break;
+	      }
+	}
+
       if (str.len == 0)
 	{
 	  for (i = 0; i < SIZEOF (cap_keyvals); i++)
@@ -256,36 +400,185 @@ _fep_key_to_string (uint32_t key,
 		break;
 	      }
 	}
+
+      /* characters are sent as text, as the terminal would; other
+	 keys without a legacy sequence can't be sent at all, since
+	 the child has not asked for the CSI u form */
+      if (str.len == 0)
+	{
+	  p = key_to_text (key);
+	  if (p)
+	    {
+	      _fep_string_append (&str, p, strlen (p));
+	      free (p);
+	    }
+	}
       break;
     }
 
+  if (esc_prefix && str.len > 0)
+    {
+      FepString prefixed;
+
+      memset (&prefixed, 0, sizeof (prefixed));
+      _fep_string_append_c (&prefixed, '\033');
+      _fep_string_append (&prefixed, str.str, str.len);
+      free (str.str);
+      str = prefixed;
+    }
+
   *r_length = str.len;
   return str.str;
 }
 
-static uint32_t
-_fep_get_state_from_cursor (FepCSI *csi)
+/* Sequences of the ASCII characters and the keysyms in 0xff00-0xffff
+   with any of Shift, Control and Alt, so that forwarding such a key
+   doesn't have to encode it each time.  An entry of length 0 is not
+   cached, either because it has no sequence or it is too long.  */
+#define KEY_TABLE_KEYS (0x80 + 0x100)
+#define KEY_TABLE_MODIFIERS (FEP_SHIFT_MASK | FEP_CONTROL_MASK | FEP_MOD1_MASK)
+
+struct KeyTableEntry
 {
-  char **params = _fep_strsplit (csi->params, ";", -1);
-  uint32_t state = 0;
-  if (_fep_strv_length (params) == 2)
-    {
-      int param, i;
-      char *endptr;
+  uint8_t length;
+  char data[15];
+};
 
-      errno = 0;
-      param = strtoul (params[1], &endptr, 10);
-      assert (errno == 0 && *endptr == '\0');
+static struct KeyTableEntry key_table[KEY_TABLE_KEYS][8];
 
-      for (i = 0; i < SIZEOF (cursor_states); i++)
-	if (cursor_states[i].param == param)
+static int
+key_table_index (uint32_t key)
+{
+  if (key < 0x80)
+    return key;
+  if ((key & ~0xffU) == 0xff00)
+    return 0x80 + (key & 0xff);
+  return -1;
+}
+
+/* Shift, Control and Alt map to bits 0, 1 and 2 */
+static int
+key_table_modifiers (uint32_t state)
+{
+  return (state & FEP_SHIFT_MASK)
+    | ((state & (FEP_CONTROL_MASK | FEP_MOD1_MASK)) >> 1);
+}
+
+/* Fill the key table.  This must be called after setupterm, since
+   some sequences come from the terminfo database.  */
+void
+_fep_key_table_init (void)
+{
+  int i, modifiers;
+
+  for (i = 0; i < KEY_TABLE_KEYS; i++)
+    for (modifiers = 0; modifiers < 8; modifiers++)
+      {
+	struct KeyTableEntry *entry = &key_table[i][modifiers];
+	uint32_t key = i < 0x80 ? i : 0xff00 + (i - 0x80);
+	uint32_t state = (modifiers & 1) | ((modifiers & 6) << 1);
+	size_t length;
+	char *data = encode_key (key, state, &length);
+
+	entry->length = 0;
+	if (data && length <= sizeof(entry->data))
 	  {
-	    state = cursor_states[i].state;
-	    break;
+	    memcpy (entry->data, data, length);
+	    entry->length = length;
 	  }
+	free (data);
+      }
+}
+
+/* Return the sequence of KEY with modifiers STATE from the key table,
+   or NULL if it is not there.  The result is owned by the table.  */
+const char *
+_fep_key_lookup (uint32_t key,
+		 uint32_t state,
+		 size_t  *r_length)
+{
+  struct KeyTableEntry *entry;
+  int index = key_table_index (key);
+
+  if (index < 0 || (state & ~KEY_TABLE_MODIFIERS) != 0)
+    return NULL;
+
+  entry = &key_table[index][key_table_modifiers (state)];
+  if (entry->length == 0)
+    return NULL;
+
+  *r_length = entry->length;
+  return entry->data;
+}
+
+/* Same as _fep_key_to_string, but without looking up the key table,
+   for the keys _fep_key_lookup has missed.  */
+char *
+_fep_key_encode (uint32_t key,
+		 uint32_t state,
+		 size_t  *r_length)
+{
+  char *data = encode_key (key, state, r_length);
+
+  if (data == NULL)
+    fep_log (FEP_LOG_LEVEL_WARNING,
+	     "no tty sequence for key %u modifiers %u",
+	     key,
+	     state);
+  return data;
+}
+
+char *
+_fep_key_to_string (uint32_t key,
+                    uint32_t state,
+                    size_t  *r_length)
+{
+  const char *cached;
+
+  cached = _fep_key_lookup (key, state, r_length);
+  if (cached)
+    return xmemdup (cached, *r_length);
+  return _fep_key_encode (key, state, r_length);
+}
+
+/* Parse the parameters NUMBER;MODIFIERS of a key sequence, ignoring
+   the sub-parameters after ':' and any further parameters.  Missing
+   values default to 1.  */
+static bool
+parse_key_params (const char   *params,
+		  unsigned int *r_number,
+		  unsigned int *r_modifiers)
+{
+  const char *p = params;
+  unsigned long values[2] = { 1, 1 };
+  int i;
+
+  for (i = 0; i < 2 && *p != '\0'; i++)
+    {
+      if (isdigit ((unsigned char) *p))
+	{
+	  char *endptr;
+
+	  errno = 0;
+	  values[i] = strtoul (p, &endptr, 10);
+	  if (errno != 0)
+	    return false;
+	  p = endptr;
+	}
+      while (*p == ':' || isdigit ((unsigned char) *p))
+	p++;
+      if (*p == ';')
+	p++;
+      else if (*p != '\0')
+	return false;
     }
-  _fep_strfreev (params);
-  return state;
+
+  if (values[1] == 0 || values[1] > 256)
+    return false;
+
+  *r_number = values[0];
+  *r_modifiers = values[1];
+  return true;
 }
 
 static bool
@@ -293,14 +586,23 @@ _fep_csi_to_cursor_key (FepCSI *csi,
 			uint32_t *r_key,
 			uint32_t *r_state)
 {
+  unsigned int number, modifiers;
   int i;
 
+  /* modified keys are sent as CSI 1 ; MODIFIERS F; in particular,
+     this keeps a late cursor position report CSI ROW ; COL R from
+     being taken as F3 */
+  if (*csi->intermediate != '\0'
+      || !parse_key_params (csi->params, &number, &modifiers)
+      || number != 1)
+    return false;
+
   for (i = 0; i < SIZEOF (cursor_keyvals); i++)
     {
       if (cursor_keyvals[i].final == csi->final)
 	{
 	  *r_key = cursor_keyvals[i].keyval;
-	  *r_state = _fep_get_state_from_cursor (csi);
+	  *r_state = modifier_param_to_state (modifiers);
 	  return true;
 	}
     }
@@ -308,6 +610,76 @@ _fep_csi_to_cursor_key (FepCSI *csi,
 }
 
 static bool
+_fep_csi_to_tilde_key (FepCSI   *csi,
+		       uint32_t *r_key,
+		       uint32_t *r_state)
+{
+  unsigned int number, modifiers;
+  int i;
+
+  if (csi->final != '~'
+      || *csi->intermediate != '\0'
+      || !parse_key_params (csi->params, &number, &modifiers))
+    return false;
+
+  for (i = 0; i < SIZEOF (tilde_keyvals); i++)
+    if (tilde_keyvals[i].number == number)
+      {
+	*r_key = tilde_keyvals[i].keyval;
+	*r_state = modifier_param_to_state (modifiers);
+	return true;
+      }
+  return false;
+}
+
+/* Decode CSI CODE;MODIFIERS u of the progressive keyboard enhancement
+   protocol.  */
+static bool
+_fep_csi_u_to_key (FepCSI   *csi,
+		   uint32_t *r_key,
+		   uint32_t *r_state)
+{
+  unsigned int code, modifiers;
+  uint32_t key = 0, state;
+  int i;
+
+  if (csi->final != 'u'
+      || *csi->intermediate != '\0'
+      || !isdigit ((unsigned char) *csi->params)
+      || !parse_key_params (csi->params, &code, &modifiers))
+    return false;
+
+  state = modifier_param_to_state (modifiers);
+
+  for (i = 0; i < SIZEOF (code_keyvals); i++)
+    if (code_keyvals[i].code == code)
+      {
+	key = code_keyvals[i].keyval;
+	break;
+      }
+
+  if (key == 0)
+    {
+      /* same as _fep_char_to_key for an uppercase letter */
+      if ((state & FEP_SHIFT_MASK) && code >= 'a' && code <= 'z')
+	key = code - ('a' - 'A');
+      else if ((code >= 0x20 && code < 0x7f) || (code >= 0xa0 && code < 0x100))
+	key = code;
+      /* the private use area holds the codes of functional keys,
+	 such as modifiers, which are not handled */
+      else if ((code >= 0x100 && code < 0xe000)
+	       || (code > 0xf8ff && code <= 0x10ffff))
+	key = 0x01000000 | code;
+      else
+	return false;
+    }
+
+  *r_key = key;
+  *r_state = state;
+  return true;
+}
+
+bool
 _fep_csi_to_key (FepCSI   *csi,
                  uint32_t *r_key,
                  uint32_t *r_state)
@@ -315,7 +687,9 @@ _fep_csi_to_key (FepCSI   *csi,
   char *csi_str;
   int i;
 
-  if (_fep_csi_to_cursor_key (csi, r_key, r_state))
+  if (_fep_csi_to_cursor_key (csi, r_key, r_state)
+      || _fep_csi_to_tilde_key (csi, r_key, r_state)
+      || _fep_csi_u_to_key (csi, r_key, r_state))
     return true;
 
   csi_str = _fep_csi_format (csi);
@@ -327,18 +701,94 @@ _fep_csi_to_key (FepCSI   *csi,
 	  size_t len = strlen (cap_str);
 	  if (strncmp (csi_str, cap_str, len) == 0)
 	    {
+	      free (csi_str);
 	      *r_key = cap_keyvals[i].keyval;
 	      *r_state = 0;
 	      return true;
 	    }
 	}
     }
+  free (csi_str);
 
   *r_key = 0;
   *r_state = 0;
   return false;
 }
 
+/* Return true if CSI is a cursor position report CSI ROW ; COL R
+   which can't be a key, that is ROW is not 1.  */
+bool
+_fep_csi_is_cpr (FepCSI *csi)
+{
+  unsigned int row, col;
+
+  return csi->final == 'R'
+    && *csi->intermediate == '\0'
+    && isdigit ((unsigned char) *csi->params)
+    && sscanf (csi->params, "%u;%u", &row, &col) == 2
+    && row != 1;
+}
+
+/* Parse the reply CSI ? FLAGS u to the query of the progressive
+   keyboard enhancement flags.  */
+bool
+_fep_esc_to_keyboard_flags (const char *str,
+			    size_t      len,
+			    uint32_t   *r_flags,
+			    char      **r_endptr)
+{
+  FepCSI *csi;
+  char *endptr;
+  bool retval = false;
+
+  csi = _fep_csi_parse (str, len, '\133', &endptr);
+  if (csi == NULL)
+    return false;
+
+  if (csi->final == 'u'
+      && *csi->intermediate == '\0'
+      && csi->params[0] == '?')
+    {
+      char *p;
+
+      errno = 0;
+      *r_flags = strtoul (csi->params + 1, &p, 10);
+      if (errno == 0 && *p == '\0')
+	{
+	  *r_endptr = endptr;
+	  retval = true;
+	}
+    }
+  _fep_csi_free (csi);
+  return retval;
+}
+
+/* Return true if STR is the beginning of an escape sequence which
+   _fep_esc_to_key might decode once more input arrives.  */
+bool
+_fep_esc_is_incomplete (const char *str, size_t len)
+{
+  const char *p;
+
+  if (len == 0 || *str != '\033')
+    return false;
+  if (len == 1)
+    return true;
+  if (str[1] != '\133' && str[1] != 'O' && str[1] != 'o')
+    return false;
+
+  /* X10 mouse report, whose three bytes follow the final byte */
+  if (len >= 3 && str[1] == '\133' && str[2] == 'M')
+    return len < 6;
+
+  /* no final byte yet after the parameter and intermediate bytes */
+  for (p = str + 2; p - str < len && '\060' <= *p && *p <= '\077'; p++)
+    ;
+  for (; p - str < len && '\040' <= *p && *p <= '\057'; p++)
+    ;
+  return p - str == len;
+}
+
 bool
 _fep_esc_to_key (const char *str,
 		 size_t len,
@@ -365,6 +815,10 @@ _fep_esc_to_key (const char *str,
 		   * VT100/VT320/xterm. */
 	case 'F': /* Esc O F == End on xterm. */
 	case 'H': /* Esc O H == Home on xterm. */
+	case 'P': /* Esc O P == F1 on VT100/xterm. */
+	case 'Q': /* Esc O Q == F2 on VT100/xterm. */
+	case 'R': /* Esc O R == F3 on VT100/xterm. */
+	case 'S': /* Esc O S == F4 on VT100/xterm. */
 	  retval = _fep_csi_to_cursor_key (csi, &key, &state);
 	  if (retval)
 	    {
@@ -420,3 +874,97 @@ _fep_esc_to_key (const char *str,
 
   return false;
 }
+
+/* Decode a mouse report, either in the SGR form CSI < B ; X ; Y M (m
+   on release) or in the X10 form CSI M followed by B, X, and Y, each
+   offset by 32.  */
+bool
+_fep_esc_to_mouse (const char    *str,
+		   size_t         len,
+		   FepEventMouse *r_event,
+		   char         **r_endptr)
+{
+  unsigned long values[3];
+  unsigned int b, base;
+  bool release;
+  char *endptr;
+
+  if (len >= 6 && memcmp (str, "\033\133M", 3) == 0)
+    {
+      int i;
+
+      for (i = 0; i < 3; i++)
+	{
+	  if ((unsigned char) str[3 + i] < 32)
+	    return false;
+	  values[i] = (unsigned char) str[3 + i] - 32;
+	}
+      /* the button is unknown on release */
+      release = (values[0] & (3 | 32 | 64 | 128)) == 3;
+      endptr = (char *) str + 6;
+    }
+  else if (len >= 3 && memcmp (str, "\033\133<", 3) == 0)
+    {
+      FepCSI *csi;
+      const char *p;
+      int i;
+      bool valid;
+
+      csi = _fep_csi_parse (str, len, '\133', &endptr);
+      if (csi == NULL)
+	return false;
+
+      valid = (csi->final == 'M' || csi->final == 'm')
+	&& *csi->intermediate == '\0';
+      for (i = 0, p = csi->params + 1; valid && i < 3; i++)
+	{
+	  char *q;
+
+	  errno = 0;
+	  values[i] = strtoul (p, &q, 10);
+	  valid = errno == 0 && q != p && *q == (i < 2 ? ';' : '\0');
+	  p = q + 1;
+	}
+      release = csi->final == 'm';
+      _fep_csi_free (csi);
+      if (!valid)
+	return false;
+    }
+  else
+    return false;
+
+  if (values[1] == 0 || values[2] == 0)
+    return false;
+
+  b = values[0];
+  base = b & 3;
+  if (b & 128)
+    r_event->button = 8 + base;
+  else if (b & 64)
+    r_event->button = 4 + base;
+  else if (base < 3)
+    r_event->button = 1 + base;
+  else
+    r_event->button = 0;
+
+  r_event->modifiers = 0;
+  if (b & 4)
+    r_event->modifiers |= FEP_SHIFT_MASK;
+  if (b & 8)
+    r_event->modifiers |= FEP_MOD1_MASK;
+  if (b & 16)
+    r_event->modifiers |= FEP_CONTROL_MASK;
+
+  if (release)
+    r_event->action = FEP_MOUSE_RELEASE;
+  else if (b & 32)
+    r_event->action = FEP_MOUSE_MOTION;
+  else
+    r_event->action = FEP_MOUSE_PRESS;
+
+  r_event->event.type = FEP_MOUSE;
+  r_event->col = values[1] - 1;
+  r_event->row = values[2] - 1;
+  *r_endptr = endptr;
+  return true;
+}
@@ -20,6 +20,7 @@
 #include <libfep/private.h>    /* _fep_strsplit_set */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 #include <locale.h>
 
@@ -33,6 +34,9 @@ usage (FILE *out, const char *program_name)
   fprintf (out,
 	   "Usage: %s OPTIONS COMMAND...\n"
 	   "where OPTIONS are:\n"
+	   "  -e, --engine=MODULE[:ARGS]\tLoad input method engine\n"
+	   "  -t, --esc-timeout=MSEC\tTime to wait for the rest of an escape sequence\n"
+	   "  -k, --kitty-keyboard\tReport modified keys with the progressive keyboard protocol\n"
 	   "  -l, --log-file=FILE\tLog file\n"
 	   "  -h, --help\tShow this help\n",
 	   program_name);
@@ -43,7 +47,9 @@ main (int argc, char **argv)
 {
   Fep *fep;
   int c;
-  char **command = NULL, *log_file = NULL;
+  char **command = NULL, *log_file = NULL, *engine = NULL;
+  int esc_timeout = -1;
+  bool kitty_keyboard = false;
 
   setlocale (LC_ALL, "");
 
@@ -52,17 +58,37 @@ main (int argc, char **argv)
       int option_index = 0;
       static struct option long_options[] =
 	{
+	  { "engine", required_argument, 0, 'e' },
+	  { "esc-timeout", required_argument, 0, 't' },
+	  { "kitty-keyboard", no_argument, 0, 'k' },
 	  { "log-file", required_argument, 0, 'l' },
 	  { "help", no_argument, 0, 'h' },
 	  { NULL, 0, 0, 0 }
 	};
-      c = getopt_long (argc, argv, "e:l:h",
+      c = getopt_long (argc, argv, "e:t:kl:h",
 		       long_options, &option_index);
       if (c == -1)
 	break;
 
       switch (c)
 	{
+	case 'e':
+	  engine = optarg;
+	  break;
+	case 't':
+	  {
+	    char *endptr;
+	    esc_timeout = strtol (optarg, &endptr, 10);
+	    if (*optarg == '\0' || *endptr != '\0' || esc_timeout < 0)
+	      {
+		fprintf (stderr, "Invalid escape timeout %s\n", optarg);
+		exit (1);
+	      }
+	  }
+	  break;
+	case 'k':
+	  kitty_keyboard = true;
+	  break;
 	case 'l':
 	  log_file = optarg;
 	  break;
@@ -94,6 +120,20 @@ main (int argc, char **argv)
     }
 
   fep = fep_new ();
+  if (esc_timeout >= 0)
+    fep_set_esc_timeout (fep, esc_timeout);
+  fep_set_kitty_keyboard (fep, kitty_keyboard);
+  if (engine != NULL)
+    {
+      char *engine_args = strchr (engine, ':');
+      if (engine_args)
+	*engine_args++ = '\0';
+      if (fep_load_engine (fep, engine, engine_args) < 0)
+	{
+	  fprintf (stderr, "Can't load engine %s\n", engine);
+	  exit (2);
+	}
+    }
   if (fep_run (fep, (const char **) command) < 0)
     {
       fprintf (stderr, "Can't run FEP command\n");
@@ -42,21 +42,68 @@
 #include <langinfo.h>
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 
-static int tty_out;
+static Fep *putp_fep;
+
+static void
+output_flush (Fep *fep)
+{
+  size_t total = 0;
+
+  while (total < fep->outbuf.len)
+    {
+      ssize_t bytes_written = write (fep->tty_out,
+				     fep->outbuf.str + total,
+				     fep->outbuf.len - total);
+      if (bytes_written < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      total += bytes_written;
+    }
+  _fep_string_clear (&fep->outbuf);
+}
+
+static void
+output_write (Fep *fep, const char *data, size_t length)
+{
+  if (fep->output_hold > 0)
+    _fep_string_append (&fep->outbuf, data, length);
+  else
+    write (fep->tty_out, data, length);
+}
+
+/* Accumulate output to tty until the matching _fep_output_release,
+   so that a series of updates reaches the terminal in one write.  */
+void
+_fep_output_hold (Fep *fep)
+{
+  fep->output_hold++;
+}
+
+void
+_fep_output_release (Fep *fep)
+{
+  assert (fep->output_hold > 0);
+  if (--fep->output_hold == 0)
+    output_flush (fep);
+}
 
 static int
 _putchar (int c)
 {
   char _c = c;
-  write (tty_out, &_c, 1);
+  output_write (putp_fep, &_c, 1);
   return c;
 }
 
 void
 _fep_putp (Fep *fep, const char *str)
 {
-  tty_out = fep->tty_out;
+  putp_fep = fep;
   tputs (str, 1, _putchar);
 }
 
@@ -108,6 +155,36 @@ apply_attr (Fep *fep, const FepSgrAttr *attr)
     }
 }
 
+/* Set attr_pty from the SGR sequence at SGR.  Returns false if it is
+   not a valid CSI sequence.  */
+static bool
+read_sgr (Fep *fep, char *sgr, size_t sgr_len)
+{
+  FepCSI *csi;
+  char **params, c;
+  FepSgrAttr attr;
+
+  csi = _fep_csi_parse (sgr, sgr_len, '\133', NULL);
+  if (csi == NULL)
+    return false;
+
+  params = _fep_strsplit (csi->params, ";", -1);
+  _fep_sgr_params_to_attr ((const char **) params,
+			   fep->sgr_codes,
+			   &attr);
+  c = sgr[sgr_len];
+  sgr[sgr_len] = '\0';
+  fep_log (FEP_LOG_LEVEL_DEBUG, "attr read %u %u %u",
+	   attr.attr,
+	   attr.foreground,
+	   attr.background);
+  sgr[sgr_len] = c;
+  _fep_strfreev (params);
+  memcpy (&fep->attr_pty, &attr, sizeof(FepSgrAttr));
+  _fep_csi_free (csi);
+  return true;
+}
+
 void
 _fep_output_string_from_pty (Fep *fep, const char *str, int str_len)
 {
@@ -118,31 +195,12 @@ _fep_output_string_from_pty (Fep *fep, const char *str, int str_len)
       size_t sgr_len;
 
       apply_attr (fep, &fep->attr_pty);
-      write (fep->tty_out, str, str_len);
+      output_write (fep, str, str_len);
 
       p = str;
       while (_fep_csi_scan (p, str_len, 'm', &sgr, &sgr_len))
 	{
-	  FepCSI *csi;
-	  csi = _fep_csi_parse (sgr, sgr_len, '\133', NULL);
-	  if (csi)
-	    {
-	      char **params = _fep_strsplit (csi->params, ";", -1), c;
-	      FepSgrAttr attr;
-	      _fep_sgr_params_to_attr ((const char **) params,
-				       fep->sgr_codes,
-				       &attr);
-	      c = sgr[sgr_len];
-	      sgr[sgr_len] = '\0';
-	      fep_log (FEP_LOG_LEVEL_DEBUG, "attr read %u %u %u",
-		       attr.attr,
-		       attr.foreground,
-		       attr.background);
-	      sgr[sgr_len] = c;
-	      _fep_strfreev (params);
-	      memcpy (&fep->attr_pty, &attr, sizeof(FepSgrAttr));
-	      _fep_csi_free (csi);
-	    }
+	  read_sgr (fep, sgr, sgr_len);
 	  p = sgr + sgr_len;
 	}
       memcpy (&fep->attr, &fep->attr_pty, sizeof(FepSgrAttr));
@@ -163,6 +221,33 @@ _fep_output_string_from_pty (Fep *fep, const char *str, int str_len)
     }
 }
 
+/* Same as _fep_output_string_from_pty, when nothing is drawn over
+   the output of the child process.  Since each SGR sequence replaces
+   attr_pty as a whole, only the last one in STR is looked for,
+   backward from the end.  */
+void
+_fep_output_string_from_pty_direct (Fep *fep, char *str, size_t str_len)
+{
+  char *p, *end = str + str_len;
+
+  apply_attr (fep, &fep->attr_pty);
+  output_write (fep, str, str_len);
+
+  /* a sequence never contains ESC, so it ends before the next one */
+  while ((p = memrchr (str, '\033', end - str)) != NULL)
+    {
+      char *sgr;
+      size_t sgr_len;
+
+      if (_fep_csi_scan (p, end - p, 'm', &sgr, &sgr_len)
+	  && read_sgr (fep, sgr, sgr_len))
+	break;
+      end = p;
+    }
+  memcpy (&fep->attr, &fep->attr_pty, sizeof(FepSgrAttr));
+  fep->cursor.row = fep->cursor.col = -1;
+}
+
 static void
 _fep_output_string_with_attribute (Fep          *fep,
                                    const char   *str,
@@ -207,7 +292,7 @@ _fep_output_string_with_attribute (Fep          *fep,
     {
       p = _fep_substring (trunc, 0, start_index);
       if (p)
-	write (fep->tty_out, p, strlen (p));
+	output_write (fep, p, strlen (p));
       free (p);
     }
 
@@ -218,7 +303,7 @@ _fep_output_string_with_attribute (Fep          *fep,
 
       p = _fep_substring (trunc, start_index, end_index);
       if (p)
-	write (fep->tty_out, p, strlen (p));
+	output_write (fep, p, strlen (p));
       free (p);
 
       if (attr->type != FEP_ATTR_TYPE_NONE)
@@ -229,7 +314,7 @@ _fep_output_string_with_attribute (Fep          *fep,
     {
       p = _fep_substring (trunc, end_index, length);
       if (p)
-	write (fep->tty_out, p, strlen (p));
+	output_write (fep, p, strlen (p));
       free (p);
     }
   free (trunc);
@@ -298,11 +383,147 @@ _fep_output_status_text (Fep          *fep,
   _fep_putp (fep, restore_cursor);
 }
 
+static int
+local_strwidth (const char *str)
+{
+  char *local = str_iconv (str, "UTF-8", nl_langinfo (CODESET));
+  int width;
+
+  if (local == NULL)
+    return -1;
+  width = _fep_strwidth (local);
+  free (local);
+  return width;
+}
+
+/* Save the cursor position during an update of the cursor text.
+   With CPR, HERE is the position queried at the start of the update,
+   or NULL if the query failed, instead of querying it again.  */
+static void
+save_cursor_at (Fep *fep, const FepPoint *here)
+{
+  if (!fep->has_cpr)
+    _fep_output_save_cursor (fep);
+  else if (here)
+    memcpy (&fep->cursor_save, here, sizeof(FepPoint));
+}
+
+/* Redraw the cursor text from the first character which differs from
+   the current one, leaving the common prefix on the screen.  Returns
+   false if that is not possible and the whole text must be redrawn.  */
+static bool
+_fep_output_update_cursor_text (Fep            *fep,
+                                const char     *text,
+                                FepAttribute   *attr,
+                                const FepPoint *here)
+{
+  const char *cursor_text = fep->cursor_text;
+  FepAttribute suffix_attr;
+  char *prefix, *local;
+  size_t prefix_length = 0;
+  int prefix_count, prefix_width, old_width, new_width, col;
+
+  /* the attribute indices would shift */
+  if (memcmp (attr, &fep->cursor_text_attr, sizeof(FepAttribute)) != 0)
+    return false;
+
+  /* the position of the text on the screen is unknown */
+  if (fep->cursor.col < 0 || (fep->has_cpr && here == NULL))
+    return false;
+
+  while (cursor_text[prefix_length] != '\0'
+	 && cursor_text[prefix_length] == text[prefix_length])
+    prefix_length++;
+  if (cursor_text[prefix_length] == '\0' && text[prefix_length] == '\0')
+    return true;
+  /* back up to the start of a UTF-8 character */
+  while (prefix_length > 0 && (text[prefix_length] & 0xC0) == 0x80)
+    prefix_length--;
+  if (prefix_length == 0)
+    return false;
+
+  prefix = xstrndup (text, prefix_length);
+  local = str_iconv (prefix, "UTF-8", nl_langinfo (CODESET));
+  free (prefix);
+  if (local == NULL)
+    return false;
+  prefix_count = _fep_charcount (local);
+  prefix_width = _fep_strwidth (local);
+  free (local);
+  old_width = local_strwidth (cursor_text);
+  new_width = local_strwidth (text);
+  if (prefix_count < 0 || prefix_width < 0 || old_width < 0 || new_width < 0)
+    return false;
+
+  /* column where the text starts */
+  col = fep->cursor.col;
+
+  save_cursor_at (fep, here);
+  if (fep->has_cpr)
+    {
+      /* the text is not at the cursor, e.g. the child process has
+	 written something */
+      if (fep->cursor_save.row != fep->cursor.row
+	  || fep->cursor_save.col != fep->cursor.col)
+	return false;
+      _fep_output_cursor_address (fep,
+				  fep->cursor.row,
+				  fep->cursor.col + prefix_width);
+    }
+  else if (parm_right_cursor != NULL)
+    _fep_putp (fep, tparm (parm_right_cursor, prefix_width));
+  else
+    {
+      _fep_output_restore_cursor (fep);
+      return false;
+    }
+
+  memcpy (&suffix_attr, attr, sizeof(FepAttribute));
+  suffix_attr.start_index = suffix_attr.start_index > prefix_count
+    ? suffix_attr.start_index - prefix_count : 0;
+  suffix_attr.end_index = suffix_attr.end_index > prefix_count
+    ? suffix_attr.end_index - prefix_count : 0;
+  _fep_output_string_with_attribute (fep,
+				     text + prefix_length,
+				     fep->winsize.ws_col - col - prefix_width,
+				     &suffix_attr);
+
+  /* erase the rest of the old text */
+  if (new_width < old_width)
+    {
+      int width = MIN (old_width, fep->winsize.ws_col - col) - new_width;
+      if (width > 0)
+	{
+	  char *spaces = xcharalloc (width);
+	  memset (spaces, ' ', width);
+	  output_write (fep, spaces, width);
+	  free (spaces);
+	}
+    }
+
+  _fep_output_restore_cursor (fep);
+
+  free (fep->cursor_text);
+  fep->cursor_text = xstrdup (text);
+  return true;
+}
+
 void
 _fep_output_cursor_text (Fep          *fep,
                          const char   *text,
                          FepAttribute *attr)
 {
+  FepPoint point, *here = NULL;
+
+  /* the cursor doesn't move until the update is done, so with CPR
+     it is queried only once */
+  if (_fep_output_get_cursor_position (fep, &point))
+    here = &point;
+
+  if (fep->cursor_text && *fep->cursor_text != '\0' && *text != '\0'
+      && _fep_output_update_cursor_text (fep, text, attr, here))
+    return;
+
   if (fep->cursor_text && *fep->cursor_text != '\0')
     {
       char *local, *spaces;
@@ -314,7 +535,7 @@ _fep_output_cursor_text (Fep          *fep,
       width = _fep_strwidth (local);
       free (local);
 
-      _fep_output_save_cursor (fep);
+      save_cursor_at (fep, here);
       if (fep->has_cpr)
 	_fep_output_cursor_address (fep,
 				    fep->cursor.row,
@@ -323,7 +544,7 @@ _fep_output_cursor_text (Fep          *fep,
       width = MIN (width, fep->winsize.ws_col - fep->cursor.col);
       spaces = xcharalloc (width);
       memset (spaces, ' ', width * sizeof(char));
-      write (fep->tty_out, spaces, width * sizeof(char));
+      output_write (fep, spaces, width * sizeof(char));
       free  (spaces);
 
       free (fep->cursor_text);
@@ -341,12 +562,10 @@ _fep_output_cursor_text (Fep          *fep,
 	  fep->cursor_text = xstrdup (text);
 	}
 
-      _fep_output_save_cursor (fep);
+      save_cursor_at (fep, here);
 
-      if (_fep_output_get_cursor_position (fep, &fep->cursor))
-	_fep_output_cursor_address (fep,
-				    fep->cursor.row,
-				    fep->cursor.col);
+      if (here)
+	_fep_output_cursor_address (fep, here->row, here->col);
 
       memcpy (&fep->cursor_text_attr, attr, sizeof(FepAttribute));
       _fep_output_string_with_attribute (fep,
@@ -386,6 +605,50 @@ _fep_output_send_data (Fep *fep, const char *data, size_t length)
   return write (fep->pty, data, length);
 }
 
+static void
+output_send_all (Fep *fep, const char *data, size_t length)
+{
+  size_t total = 0;
+
+  while (total < length)
+    {
+      ssize_t bytes_sent = _fep_output_send_data (fep,
+						  data + total,
+						  length - total);
+      if (bytes_sent < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+      total += bytes_sent;
+    }
+}
+
+/* Send the sequence of KEY with modifiers STATE to the child process,
+   from the key table if possible.  */
+void
+_fep_output_send_key (Fep *fep, uint32_t key, uint32_t state)
+{
+  const char *cached;
+  char *data;
+  size_t length;
+
+  cached = _fep_key_lookup (key, state, &length);
+  if (cached)
+    {
+      output_send_all (fep, cached, length);
+      return;
+    }
+
+  data = _fep_key_encode (key, state, &length);
+  if (data)
+    {
+      output_send_all (fep, data, length);
+      free (data);
+    }
+}
+
 void
 _fep_output_set_screen_size (Fep *fep, int col, int row)
 {
@@ -403,64 +666,128 @@ _fep_output_dsr_cpr (Fep *fep, FepPoint *point)
   char buf[16];
 #define RETRY 2;
   int retry = RETRY
+  bool retval = false;
 
   _fep_putp (fep, "\033\1336n"); /* DSR-CPR */
+  /* the terminal must see the query before we wait for the report */
+  output_flush (fep);
   memset (&csibuf, 0, sizeof(FepString));
   while (--retry > 0)
     {
+      struct pollfd pfd;
       ssize_t bytes_read;
       char *csi;
       size_t csi_len;
 
-      bytes_read = _fep_read (fep, buf, sizeof(buf));
+      /* the tty is set up so that read blocks until input arrives;
+	 wait as long as VTIME used to allow for the report */
+      pfd.fd = fep->tty_in;
+      pfd.events = POLLIN;
+      if (poll (&pfd, 1, 300) <= 0)
+	continue;
+
+      /* the input already in fep->ttybuf was typed before the query,
+	 so the report can only be in what is read from now on */
+      bytes_read = read (fep->tty_in, buf, sizeof(buf));
       if (bytes_read < 0)
-	{
-	  free (csibuf.str);
-	  return false;
-	}
+	break;
       _fep_string_append (&csibuf, buf, bytes_read);
       if (_fep_csi_scan (csibuf.str, csibuf.len, 'R', &csi, &csi_len))
 	{
-	  const char *csi_end;
+	  const char *csi_end = csi + csi_len;
 	  char **strv, *endptr;
 
+	  /* push back the input around CPR, to be processed later */
+	  _fep_ring_write (&fep->ttybuf, csibuf.str, csi - csibuf.str);
+	  _fep_ring_write (&fep->ttybuf,
+			   csi_end,
+			   csibuf.len - (csi_end - csibuf.str));
+
 	  csi[csi_len - 1] = '\0';
 	  strv = _fep_strsplit (csi + 2, ";", 2);
 	  errno = 0;
 	  point->row = strtoul (strv[0], &endptr, 10);
-	  if (errno != 0 || *endptr != '\0')
-	    {
-	      _fep_strfreev (strv);
-	      free (csibuf.str);
-	      return false;
-	    }
-	  point->col = strtoul (strv[1], &endptr, 10);
-	  if (errno != 0 || *endptr != '\0')
+	  if (errno == 0 && *endptr == '\0' && strv[1] != NULL)
 	    {
-	      _fep_strfreev (strv);
-	      free (csibuf.str);
-	      return false;
+	      point->col = strtoul (strv[1], &endptr, 10);
+	      retval = errno == 0 && *endptr == '\0';
 	    }
 	  _fep_strfreev (strv);
-
-	  /* rewind data around CPR */
-	  _fep_string_append (&fep->ttybuf,
-			      csibuf.str,
-			      csi - csibuf.str);
-	  csi_end = csi + csi_len;
-	  _fep_string_append (&fep->ttybuf,
-			      csi_end,
-			      bytes_read - (csi_end - csibuf.str));
 	  free (csibuf.str);
-	  return true;
+	  return retval;
+	}
+    }
+  /* no report; don't lose what was typed meanwhile */
+  _fep_ring_write (&fep->ttybuf, csibuf.str, csibuf.len);
+  free (csibuf.str);
+  return false;
+}
+
+/* Query the flags of the progressive keyboard enhancement protocol.
+   DA1 is sent after the query, since every terminal answers it: if
+   its report comes without the flags, the protocol is unsupported.  */
+bool
+_fep_output_query_kitty_keyboard (Fep *fep, uint32_t *r_flags)
+{
+  FepString csibuf;
+  char buf[64];
+  bool retval = false;
+
+  _fep_putp (fep, "\033\133?u\033\133c");
+  output_flush (fep);
+  memset (&csibuf, 0, sizeof(FepString));
+  while (true)
+    {
+      struct pollfd pfd;
+      ssize_t bytes_read;
+      char *da, *reply, *endptr;
+      size_t da_len, reply_len;
+
+      pfd.fd = fep->tty_in;
+      pfd.events = POLLIN;
+      if (poll (&pfd, 1, 300) <= 0)
+	break;
+
+      bytes_read = read (fep->tty_in, buf, sizeof(buf));
+      if (bytes_read <= 0)
+	break;
+      _fep_string_append (&csibuf, buf, bytes_read);
+      if (!_fep_csi_scan (csibuf.str, csibuf.len, 'c', &da, &da_len))
+	continue;
+
+      /* push back the input around the reports, to be processed
+	 later */
+      if (_fep_csi_scan (csibuf.str, da - csibuf.str, 'u', &reply, &reply_len)
+	  && _fep_esc_to_keyboard_flags (reply, reply_len, r_flags, &endptr))
+	{
+	  _fep_ring_write (&fep->ttybuf, csibuf.str, reply - csibuf.str);
+	  _fep_ring_write (&fep->ttybuf, endptr, da - endptr);
+	  retval = true;
 	}
-      if (csi == NULL)
-	_fep_string_append (&csibuf, buf, bytes_read);
+      else
+	_fep_ring_write (&fep->ttybuf, csibuf.str, da - csibuf.str);
+      _fep_ring_write (&fep->ttybuf,
+		       da + da_len,
+		       csibuf.len - (da + da_len - csibuf.str));
+      free (csibuf.str);
+      return retval;
     }
+  /* no report; don't lose what was typed meanwhile */
+  _fep_ring_write (&fep->ttybuf, csibuf.str, csibuf.len);
   free (csibuf.str);
   return false;
 }
 
+/* Push the "disambiguate escape codes" flag of the progressive
+   keyboard enhancement protocol onto the terminal's stack, or pop it
+   to restore the previous mode.  */
+void
+_fep_output_kitty_keyboard (Fep *fep, bool enable)
+{
+  _fep_putp (fep, enable ? "\033\133>1u" : "\033\133<u");
+  output_flush (fep);
+}
+
 void
 _fep_output_init_screen (Fep *fep)
 {
@@ -82,6 +82,45 @@ struct _FepSgrAttr {
 };
 typedef struct _FepSgrAttr FepSgrAttr;
 
+/* Ring buffer of bytes.  HEAD and TAIL are offsets which only grow,
+   and CAP is a power of two, so that the position of an offset is
+   OFFSET & (CAP - 1).  */
+struct _FepRing {
+  char *data;
+  size_t cap;
+  size_t head;
+  size_t tail;
+};
+typedef struct _FepRing FepRing;
+
+struct _FepControlClient
+{
+  int fd;
+  /* shared memory transport, if requested by the client */
+  FepShm *shm;
+  /* nesting level of BEGIN, and messages queued until COMMIT */
+  int transaction_depth;
+  FepList *transaction;
+  /* keys to be sent to the client, set by SUBSCRIBE_KEYS; if not
+     subscribed, all keys are sent */
+  bool key_subscribed;
+  FepKeySubscriptionFlags key_flags;
+  FepKeyPattern *key_patterns;
+  size_t n_key_patterns;
+  /* cursor text last set by the client, which SET_CURSOR_TEXT_DELTA
+     applies to, and whether it is non-empty */
+  char *cursor_text;
+  bool composing;
+  /* key events go to clients with higher priority first; observers
+     are only notified */
+  int priority;
+  bool observer;
+  /* notifications lost in a row since the client stopped reading */
+#define FEP_MAX_DROPPED 64
+  unsigned int n_dropped;
+};
+typedef struct _FepControlClient FepControlClient;
+
 struct _Fep
 {
   /* input/output via tty */
@@ -95,15 +134,39 @@ struct _Fep
   int server;
   char *control_socket_path;
 #define FEP_MAX_CLIENTS 10
-  int clients[FEP_MAX_CLIENTS];
+  FepControlClient clients[FEP_MAX_CLIENTS];
   size_t n_clients;
+  /* bumped whenever the keys the clients want may have changed, to
+     tell if wanted_chars is up to date */
+  unsigned int subscription_serial;
+  unsigned int wanted_serial;
+  uint32_t wanted_chars[4];
+  bool wanted_passthrough;
+
+  /* input from tty not yet processed, including what was read while
+     waiting for a CPR */
+  FepRing ttybuf;
 
-  /* input buffer for tty (used by ungetc) */
-  FepString ttybuf;
+  /* an incomplete escape sequence at the end of ttybuf is held until
+     it completes or esc_deadline (in microseconds of
+     _fep_get_monotonic_time) passes */
+  int esc_timeout;
+  bool esc_pending;
+  uint32_t esc_deadline;
+
+  /* whether to use the progressive keyboard enhancement protocol,
+     and whether the terminal has enabled it; keys it encodes as CSI u
+     are translated back to the legacy sequences for the child */
+  bool use_kitty_keyboard;
+  bool kitty_keyboard;
 
   /* input buffer for pty (to keep incomplete escape sequences from pty) */
   FepString ptybuf;
 
+  /* output to tty held by _fep_output_hold */
+  FepString outbuf;
+  int output_hold;
+
   bool has_cpr;
 
   /* support for SGR */
@@ -122,6 +185,17 @@ struct _Fep
 
   struct winsize winsize;
   struct termios orig_termios;
+
+  /* engine loaded by fep_load_engine */
+  void *engine_module;
+  FepEngine *engine;
+  FepEngineHost engine_host;
+  /* text the engine returned last, which may have been replaced on
+     the screen by the clients */
+  char *engine_cursor_text;
+  FepAttribute engine_cursor_text_attr;
+  char *engine_status_text;
+  FepAttribute engine_status_text_attr;
 };
 
 struct _FepCSI
@@ -161,29 +235,66 @@ void             _fep_sgr_attr_from_attribute
 const char *     _fep_cap_get_string       (const char         *name);
 
 /* key.c */
+bool             _fep_esc_is_incomplete    (const char         *str,
+                                            size_t              len);
 bool             _fep_esc_to_key           (const char         *str,
                                             size_t              len,
                                             uint32_t           *r_key,
                                             uint32_t           *r_state,
                                             char              **r_endptr);
+bool             _fep_esc_to_mouse         (const char         *str,
+                                            size_t              len,
+                                            FepEventMouse      *r_event,
+                                            char              **r_endptr);
+bool             _fep_csi_to_key           (FepCSI             *csi,
+                                            uint32_t           *r_key,
+                                            uint32_t           *r_state);
+bool             _fep_csi_is_cpr           (FepCSI             *csi);
+bool             _fep_esc_to_keyboard_flags
+                                           (const char         *str,
+                                            size_t              len,
+                                            uint32_t           *r_flags,
+                                            char              **r_endptr);
 bool             _fep_char_to_key          (char                tty,
                                             uint32_t           *r_key,
                                             uint32_t           *r_state);
 char            *_fep_key_to_string        (uint32_t            key,
 					    uint32_t            state,
 					    size_t  *r_length);
+char            *_fep_key_encode           (uint32_t            key,
+                                            uint32_t            state,
+                                            size_t             *r_length);
+void             _fep_key_table_init       (void);
+const char      *_fep_key_lookup           (uint32_t            key,
+                                            uint32_t            state,
+                                            size_t             *r_length);
 
 /* input.c */
-ssize_t          _fep_read                 (Fep                *fep,
-                                            void               *buf,
+void             _fep_ring_write           (FepRing            *ring,
+                                            const char         *data,
+                                            size_t              count);
+ssize_t          _fep_ring_read            (FepRing            *ring,
+                                            int                 fd,
                                             size_t              count);
+size_t           _fep_ring_peek            (const FepRing      *ring,
+                                            char               *buf,
+                                            size_t              count);
+void             _fep_ring_consume         (FepRing            *ring,
+                                            size_t              count);
+size_t           _fep_ring_length          (const FepRing      *ring);
+void             _fep_ring_free            (FepRing            *ring);
+ssize_t          _fep_read                 (Fep                *fep);
 int              _fep_pselect              (Fep                *fep,
                                             fd_set             *fds,
                                             sigset_t           *sigmask);
+size_t           _fep_scan_printable       (const char         *buf,
+                                            size_t              len);
 
 /* output.c */
 void             _fep_putp                 (Fep                *fep,
                                             const char         *str);
+void             _fep_output_hold          (Fep                *fep);
+void             _fep_output_release       (Fep                *fep);
 void             _fep_output_set_attributes
                                            (Fep                *fep,
 					    const FepSgrAttr   *attr);
@@ -199,6 +310,10 @@ void             _fep_output_string_from_pty
                                            (Fep                *fep,
                                             const char         *str,
                                             int                 str_len);
+void             _fep_output_string_from_pty_direct
+                                           (Fep                *fep,
+                                            char               *str,
+                                            size_t              str_len);
 void             _fep_output_cursor_text   (Fep                *fep,
                                             const char         *text,
 					    FepAttribute       *attr);
@@ -212,6 +327,9 @@ void             _fep_output_send_text     (Fep                *fep,
 ssize_t          _fep_output_send_data     (Fep                *fep,
                                             const char         *data,
 					    size_t              length);
+void             _fep_output_send_key      (Fep                *fep,
+                                            uint32_t            key,
+                                            uint32_t            state);
 void             _fep_output_set_screen_size
                                            (Fep                *fep,
                                             int                 col,
@@ -220,20 +338,46 @@ void             _fep_output_init_screen   (Fep                *fep);
 bool             _fep_output_get_cursor_position
                                            (Fep                *fep,
                                             FepPoint           *point);
+bool             _fep_output_query_kitty_keyboard
+                                           (Fep                *fep,
+                                            uint32_t           *r_flags);
+void             _fep_output_kitty_keyboard
+                                           (Fep                *fep,
+                                            bool                enable);
+
+/* engine.c */
+void             _fep_unload_engine        (Fep                *fep);
+bool             _fep_engine_filter_event  (Fep                *fep,
+                                            FepEvent           *event);
 
 /* control.c */
 int              _fep_open_control_socket  (Fep                *fep);
 void             _fep_close_control_socket (Fep                *fep);
-int              _fep_read_control_message_from_fd
+void             _fep_close_control_client (Fep                *fep,
+                                            FepControlClient   *client);
+int              _fep_read_control_message_from_client
                                            (Fep                *fep,
-					    int                fd,
+					    FepControlClient   *client,
 					    FepControlMessage  *message);
 int              _fep_dispatch_control_message
                                            (Fep                *fep,
+                                            FepControlClient   *client,
+                                            FepControlMessage  *message);
+int              _fep_write_control_message_to_client
+                                           (Fep                *fep,
+                                            FepControlClient   *client,
+                                            FepControlMessage  *message);
+int              _fep_notify_control_client
+                                           (Fep                *fep,
+                                            FepControlClient   *client,
                                             FepControlMessage  *message);
+bool             _fep_control_client_wants_key
+                                           (FepControlClient   *client,
+                                            uint32_t            keyval,
+                                            uint32_t            state);
 int              _fep_transceive_control_message
                                            (Fep                *fep,
-					    int                fd,
+					    FepControlClient   *client,
 					    FepControlMessage  *request,
 					    FepControlMessage  *response);
 
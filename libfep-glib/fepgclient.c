@@ -23,6 +23,8 @@
 #include <libfep-glib/libfep-glib.h>
 #include <libfep-glib/fepgmarshalers.h>
 #include <libfep/libfep.h>
+#include <glib-unix.h>
+#include <poll.h>
 
 /**
  * SECTION:fepgclient
@@ -32,7 +34,8 @@
 enum
   {
     PROP_0,
-    PROP_ADDRESS
+    PROP_ADDRESS,
+    PROP_NONBLOCKING
   };
 
 enum
@@ -48,9 +51,11 @@ static guint signals[LAST_SIGNAL] = {0};
 #define I_(string) g_intern_static_string (string)
 
 static void initable_iface_init (GInitableIface *initable_iface);
+static void async_initable_iface_init (GAsyncInitableIface *async_initable_iface);
 
 G_DEFINE_TYPE_WITH_CODE (FepGClient, fep_g_client, G_TYPE_OBJECT,
-			 G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, initable_iface_init));
+			 G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, initable_iface_init)
+			 G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE, async_initable_iface_init));
 
 #define FEP_G_CLIENT_GET_PRIVATE(obj)                                \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), FEP_TYPE_G_CLIENT, FepGClientPrivate))
@@ -59,29 +64,88 @@ struct _FepGClientPrivate
 {
   FepClient *client;
   char *address;
+  gboolean nonblocking;
 };
 
+/* Whether signal ID needs to be emitted; if not, the class handler
+   is called directly, without the marshalling.  */
+static gboolean
+has_handler_pending (FepGClient *client, guint id)
+{
+  return g_signal_has_handler_pending (client, signals[id], 0, FALSE);
+}
+
 static int
 event_filter (FepEvent *event,
               void     *data)
 {
   FepGClient *client = FEP_G_CLIENT (data);
+  FepGClientClass *klass = FEP_G_CLIENT_GET_CLASS (client);
   gboolean retval = FALSE;
-  FepGEvent *gevent = fep_g_event_copy ((FepGEvent *) event);
+  FepGEvent gevent;
+
+  /* The event passed to the signal handlers borrows the fields of
+     EVENT, which are valid until the filter returns.  */
+  switch (event->type)
+    {
+    case FEP_KEY_PRESS:
+      {
+	FepEventKey *key = (FepEventKey *) event;
+	gevent.key.type = FEP_G_EVENT_TYPE_KEY_PRESS;
+	gevent.key.keyval = key->keyval;
+	gevent.key.modifiers = key->modifiers;
+	gevent.key.source = key->source;
+	gevent.key.source_length = key->source_length;
+      }
+      break;
+    case FEP_RESIZED:
+      {
+	FepEventResize *resize = (FepEventResize *) event;
+	gevent.resize.type = FEP_G_EVENT_TYPE_RESIZED;
+	gevent.resize.cols = resize->cols;
+	gevent.resize.rows = resize->rows;
+      }
+      break;
+    case FEP_MOUSE:
+      {
+	FepEventMouse *mouse = (FepEventMouse *) event;
+	gevent.mouse.type = FEP_G_EVENT_TYPE_MOUSE;
+	gevent.mouse.action = mouse->action;
+	gevent.mouse.button = mouse->button;
+	gevent.mouse.modifiers = mouse->modifiers;
+	gevent.mouse.col = mouse->col;
+	gevent.mouse.row = mouse->row;
+      }
+      break;
+    default:
+      return 0;
+    }
 
-  g_signal_emit (client, signals[FILTER_EVENT_SIGNAL], 0, gevent, &retval);
+  if (has_handler_pending (client, FILTER_EVENT_SIGNAL))
+    g_signal_emit (client, signals[FILTER_EVENT_SIGNAL], 0,
+		   &gevent, &retval);
+  else if (klass->filter_event)
+    retval = klass->filter_event (client, &gevent);
 
   if (!retval)
     {
-      switch (event->type)
+      switch (gevent.any.type)
 	{
-	case FEP_KEY_PRESS:
-	  g_signal_emit (client, signals[FILTER_KEY_EVENT_SIGNAL], 0,
-			 gevent->key.keyval, gevent->key.modifiers, &retval);
+	case FEP_G_EVENT_TYPE_KEY_PRESS:
+	  if (has_handler_pending (client, FILTER_KEY_EVENT_SIGNAL))
+	    g_signal_emit (client, signals[FILTER_KEY_EVENT_SIGNAL], 0,
+			   gevent.key.keyval, gevent.key.modifiers, &retval);
+	  else if (klass->filter_key_event)
+	    retval = klass->filter_key_event (client,
+					      gevent.key.keyval,
+					      gevent.key.modifiers);
 	  break;
-	case FEP_RESIZED:
-	  g_signal_emit (client, signals[RESIZED_SIGNAL], 0,
-			 gevent->resize.cols, gevent->resize.rows);
+	case FEP_G_EVENT_TYPE_RESIZED:
+	  if (has_handler_pending (client, RESIZED_SIGNAL))
+	    g_signal_emit (client, signals[RESIZED_SIGNAL], 0,
+			   gevent.resize.cols, gevent.resize.rows);
+	  else if (klass->resized)
+	    klass->resized (client, gevent.resize.cols, gevent.resize.rows);
 	  break;
 	default:
 	  break;
@@ -98,7 +162,10 @@ initable_init (GInitable    *initable,
   FepGClient *client = FEP_G_CLIENT (initable);
   FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
 
-  priv->client = fep_client_open (priv->address);
+  priv->client = fep_client_open_full (priv->address,
+				       priv->nonblocking
+				       ? FEP_CLIENT_NONBLOCK
+				       : FEP_CLIENT_NONE);
   if (priv->client)
     {
       fep_client_set_event_filter (priv->client,
@@ -110,6 +177,8 @@ initable_init (GInitable    *initable,
 #endif
       return TRUE;
     }
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+	       "can't connect to the FEP server");
   return FALSE;
 }
 
@@ -119,6 +188,52 @@ initable_iface_init (GInitableIface *initable_iface)
   initable_iface->init = initable_init;
 }
 
+static void
+init_in_thread (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  GError *error = NULL;
+
+  if (initable_init (G_INITABLE (source_object), cancellable, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+static void
+async_initable_init_async (GAsyncInitable     *initable,
+                           int                 io_priority,
+                           GCancellable       *cancellable,
+                           GAsyncReadyCallback callback,
+                           gpointer            user_data)
+{
+  GTask *task = g_task_new (initable, cancellable, callback, user_data);
+
+  /* Connecting and setting up the shared memory transport may block,
+     so do it in a worker thread.  */
+  g_task_set_priority (task, io_priority);
+  g_task_run_in_thread (task, init_in_thread);
+  g_object_unref (task);
+}
+
+static gboolean
+async_initable_init_finish (GAsyncInitable *initable,
+                            GAsyncResult   *res,
+                            GError        **error)
+{
+  g_return_val_if_fail (g_task_is_valid (res, initable), FALSE);
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+async_initable_iface_init (GAsyncInitableIface *async_initable_iface)
+{
+  async_initable_iface->init_async = async_initable_init_async;
+  async_initable_iface->init_finish = async_initable_init_finish;
+}
+
 static gboolean
 fep_g_client_real_filter_key_event (FepGClient *client,
 				    guint       keyval,
@@ -158,6 +273,9 @@ fep_g_client_set_property (GObject      *object,
     case PROP_ADDRESS:
       priv->address = g_value_dup_string (value);
       break;
+    case PROP_NONBLOCKING:
+      priv->nonblocking = g_value_get_boolean (value);
+      break;
     default:
       g_object_set_property (object,
 			     g_param_spec_get_name (pspec),
@@ -180,6 +298,9 @@ fep_g_client_get_property (GObject    *object,
     case PROP_ADDRESS:
       g_value_set_string (value, priv->address);
       break;
+    case PROP_NONBLOCKING:
+      g_value_set_boolean (value, priv->nonblocking);
+      break;
     default:
       g_object_get_property (object,
 			     g_param_spec_get_name (pspec),
@@ -268,6 +389,8 @@ fep_g_client_class_init (FepGClientClass *klass)
    * @event: a #FepGEvent
    *
    * The ::filter-event signal is emitted when key event is dispatched.
+   * @event is only valid during the emission; use fep_g_event_copy()
+   * to keep it.
    */
   signals[FILTER_EVENT_SIGNAL] =
     g_signal_new (I_("filter-event"),
@@ -292,6 +415,18 @@ fep_g_client_class_init (FepGClientClass *klass)
   g_object_class_install_property (gobject_class,
 				   PROP_ADDRESS,
 				   pspec);
+
+  pspec = g_param_spec_boolean ("nonblocking",
+				"nonblocking",
+				"Buffer requests instead of blocking",
+				FALSE,
+				G_PARAM_READABLE |
+				G_PARAM_WRITABLE |
+				G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_property (gobject_class,
+				   PROP_NONBLOCKING,
+				   pspec);
 }
 
 static void
@@ -324,6 +459,62 @@ fep_g_client_new (const char   *address,
 			 NULL);
 }
 
+/**
+ * fep_g_client_new_async:
+ * @address: (allow-none): socket address of the FEP server
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the connection is
+ *  established
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronously connect to the FEP server running at @address, like
+ * fep_g_client_new().  Unlike fep_g_client_new(), the client is
+ * created with #FepGClient:nonblocking set, so that sending requests
+ * never blocks the main loop; see fep_g_client_flush_async().
+ *
+ * Call fep_g_client_new_finish() from @callback to get the result.
+ */
+void
+fep_g_client_new_async (const char         *address,
+                        int                 io_priority,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data)
+{
+  g_async_initable_new_async (FEP_TYPE_G_CLIENT,
+			      io_priority,
+			      cancellable,
+			      callback,
+			      user_data,
+			      "address", address,
+			      "nonblocking", TRUE,
+			      NULL);
+}
+
+/**
+ * fep_g_client_new_finish:
+ * @res: a #GAsyncResult
+ * @error: a pointer to a NULL #GError, or %NULL
+ *
+ * Finish an operation started with fep_g_client_new_async().
+ *
+ * Returns: (transfer full): a new #FepGClient, or %NULL on error.
+ */
+FepGClient *
+fep_g_client_new_finish (GAsyncResult *res,
+                         GError      **error)
+{
+  GObject *source_object = g_async_result_get_source_object (res);
+  GObject *object;
+
+  object = g_async_initable_new_finish (G_ASYNC_INITABLE (source_object),
+					res,
+					error);
+  g_object_unref (source_object);
+  return object ? FEP_G_CLIENT (object) : NULL;
+}
+
 /**
  * fep_g_client_set_cursor_text:
  * @client: a #FepGClient
@@ -343,6 +534,32 @@ fep_g_client_set_cursor_text (FepGClient    *client,
 			      (FepAttribute *) attr);
 }
 
+/**
+ * fep_g_client_update_cursor_text:
+ * @client: a #FepGClient
+ * @start: byte offset where the change starts
+ * @end: byte offset where the change ends
+ * @text: text replacing the bytes from @start to @end
+ * @attr: (allow-none): a #FepGAttribute
+ *
+ * Request to replace bytes from @start to @end of the cursor text
+ * last set by @client with @text.  See fep_client_update_cursor_text().
+ */
+void
+fep_g_client_update_cursor_text (FepGClient    *client,
+                                 gsize          start,
+                                 gsize          end,
+                                 const char    *text,
+                                 FepGAttribute *attr)
+{
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  fep_client_update_cursor_text (priv->client,
+				 start,
+				 end,
+				 text,
+				 (FepAttribute *) attr);
+}
+
 /**
  * fep_g_client_set_status_text:
  * @client: a #FepGClient
@@ -396,6 +613,27 @@ fep_g_client_send_data (FepGClient *client,
   fep_client_send_data (priv->client, data, length);
 }
 
+/**
+ * fep_g_client_send_bytes:
+ * @client: a #FepGClient
+ * @bytes: a #GBytes
+ *
+ * Request to send the contents of @bytes to the child process of the
+ * FEP server, like fep_g_client_send_data().  The data is encoded
+ * directly from @bytes, which is not referenced after this call.
+ */
+void
+fep_g_client_send_bytes (FepGClient *client,
+                         GBytes     *bytes)
+{
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  gconstpointer data;
+  gsize length;
+
+  data = g_bytes_get_data (bytes, &length);
+  fep_client_send_data (priv->client, data, length);
+}
+
 /**
  * fep_g_client_forward_key_event:
  * @client: a #FepGClient
@@ -413,6 +651,33 @@ fep_g_client_forward_key_event (FepGClient *client,
   fep_client_forward_key_event (priv->client, keyval, modifiers);
 }
 
+/**
+ * fep_g_client_begin:
+ * @client: a #FepGClient
+ *
+ * Start a group of requests which the server applies at once, when
+ * fep_g_client_commit() is called.
+ */
+void
+fep_g_client_begin (FepGClient *client)
+{
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  fep_client_begin (priv->client);
+}
+
+/**
+ * fep_g_client_commit:
+ * @client: a #FepGClient
+ *
+ * Finish a group of requests started with fep_g_client_begin().
+ */
+void
+fep_g_client_commit (FepGClient *client)
+{
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  fep_client_commit (priv->client);
+}
+
 /**
  * fep_g_client_get_poll_fd:
  * @client: a #FepGClient
@@ -443,3 +708,227 @@ fep_g_client_dispatch (FepGClient *client)
   gint retval = fep_client_dispatch (priv->client);
   return retval == 0;
 }
+
+/* Write out the buffered requests as far as possible, and complete
+   TASK if they are all written or on error.  Returns TRUE if TASK
+   needs to wait for another attempt.  */
+static gboolean
+flush_pending (GTask *task)
+{
+  FepGClient *client = g_task_get_source_object (task);
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  gint retval;
+
+  if (g_task_return_error_if_cancelled (task))
+    return FALSE;
+
+  retval = fep_client_flush (priv->client);
+  if (retval < 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+			       "can't write to the FEP server");
+      return FALSE;
+    }
+  if (retval == 0)
+    {
+      g_task_return_boolean (task, TRUE);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+flush_fd_ready (gint         fd,
+                GIOCondition condition,
+                gpointer     user_data)
+{
+  return flush_pending (user_data);
+}
+
+static gboolean
+flush_timeout (gpointer user_data)
+{
+  return flush_pending (user_data);
+}
+
+/**
+ * fep_g_client_flush_async:
+ * @client: a #FepGClient
+ * @io_priority: the I/O priority of the request
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the requests are
+ *  written
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronously write out the requests buffered by a client created
+ * with #FepGClient:nonblocking set.  Requests sent with the other
+ * functions in the meantime are also written before @callback is
+ * called.  Call fep_g_client_flush_finish() from @callback to get the
+ * result.
+ */
+void
+fep_g_client_flush_async (FepGClient         *client,
+                          int                 io_priority,
+                          GCancellable       *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer            user_data)
+{
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client);
+  GTask *task;
+  GSource *source;
+
+  task = g_task_new (client, cancellable, callback, user_data);
+  g_task_set_priority (task, io_priority);
+
+  if (flush_pending (task))
+    {
+      /* With the shared memory transport there is no descriptor to
+	 wait for space in the ring, so retry periodically.  */
+      if (fep_client_get_poll_events (priv->client) & POLLOUT)
+	{
+	  source = g_unix_fd_source_new (fep_client_get_poll_fd (priv->client),
+					 G_IO_OUT);
+	  g_task_attach_source (task, source, (GSourceFunc) flush_fd_ready);
+	}
+      else
+	{
+	  source = g_timeout_source_new (1);
+	  g_task_attach_source (task, source, flush_timeout);
+	}
+      g_source_unref (source);
+    }
+  g_object_unref (task);
+}
+
+/**
+ * fep_g_client_flush_finish:
+ * @client: a #FepGClient
+ * @res: a #GAsyncResult
+ * @error: a pointer to a NULL #GError, or %NULL
+ *
+ * Finish an operation started with fep_g_client_flush_async().
+ *
+ * Returns: %TRUE if all the requests are written, %FALSE on error.
+ */
+gboolean
+fep_g_client_flush_finish (FepGClient   *client,
+                           GAsyncResult *res,
+                           GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (res, client), FALSE);
+  return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+typedef struct _FepGClientSource FepGClientSource;
+struct _FepGClientSource
+{
+  GSource source;
+  GPollFD pollfd;
+  FepGClient *client;
+};
+
+static gboolean
+client_source_prepare (GSource *source,
+                       gint    *timeout)
+{
+  FepGClientSource *client_source = (FepGClientSource *) source;
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client_source->client);
+  gint events = fep_client_get_poll_events (priv->client);
+
+  client_source->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+  if (events & POLLOUT)
+    client_source->pollfd.events |= G_IO_OUT;
+
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean
+client_source_check (GSource *source)
+{
+  FepGClientSource *client_source = (FepGClientSource *) source;
+  return (client_source->pollfd.revents & client_source->pollfd.events) != 0;
+}
+
+static gboolean
+client_source_dispatch (GSource    *source,
+                        GSourceFunc callback,
+                        gpointer    user_data)
+{
+  FepGClientSource *client_source = (FepGClientSource *) source;
+  FepGClientPrivate *priv = FEP_G_CLIENT_GET_PRIVATE (client_source->client);
+  gushort revents = client_source->pollfd.revents;
+
+  if (revents & G_IO_OUT)
+    {
+      if (fep_client_flush (priv->client) < 0)
+	return FALSE;
+    }
+
+  if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+    {
+      /* Read all the requests available at this wakeup, so that the
+	 responses are written at once instead of one iteration of the
+	 main loop per request.  */
+      if (fep_client_dispatch_pending (priv->client) < 0)
+	return FALSE;
+    }
+
+  if (callback)
+    return callback (user_data);
+  return TRUE;
+}
+
+static void
+client_source_finalize (GSource *source)
+{
+  FepGClientSource *client_source = (FepGClientSource *) source;
+  g_object_unref (client_source->client);
+}
+
+static GSourceFuncs client_source_funcs =
+  {
+    client_source_prepare,
+    client_source_check,
+    client_source_dispatch,
+    client_source_finalize
+  };
+
+/**
+ * fep_g_client_create_source:
+ * @client: a #FepGClient
+ *
+ * Create a #GSource which dispatches the requests from the server
+ * whenever the control socket becomes readable.  Unlike calling
+ * fep_g_client_dispatch() from a #GIOChannel watch, all the requests
+ * available at a wakeup are dispatched in one go.  The source also
+ * writes out buffered messages when the socket becomes writable.
+ *
+ * The source is removed when the connection fails.  Use
+ * g_source_set_priority() to choose its priority relative to the
+ * other sources, and g_source_attach() to add it to a main context.
+ * A callback of type #GSourceFunc may be set with
+ * g_source_set_callback(); it is called after each wakeup and the
+ * source is removed if it returns %FALSE.
+ *
+ * Returns: (transfer full): a new #GSource
+ */
+GSource *
+fep_g_client_create_source (FepGClient *client)
+{
+  FepGClientSource *client_source;
+  GSource *source;
+
+  g_return_val_if_fail (FEP_IS_G_CLIENT (client), NULL);
+
+  source = g_source_new (&client_source_funcs, sizeof (FepGClientSource));
+  g_source_set_name (source, "FepGClient");
+
+  client_source = (FepGClientSource *) source;
+  client_source->client = g_object_ref (client);
+  client_source->pollfd.fd = fep_g_client_get_poll_fd (client);
+  client_source->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+  g_source_add_poll (source, &client_source->pollfd);
+
+  return source;
+}
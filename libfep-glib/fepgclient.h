@@ -70,9 +70,22 @@ GType        fep_g_client_get_type          (void) G_GNUC_CONST;
 FepGClient * fep_g_client_new               (const char    *address,
                                              GCancellable  *cancellable,
                                              GError       **error);
+void         fep_g_client_new_async         (const char    *address,
+                                             int            io_priority,
+                                             GCancellable  *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer       user_data);
+FepGClient * fep_g_client_new_finish        (GAsyncResult  *res,
+                                             GError       **error);
 void         fep_g_client_set_cursor_text   (FepGClient    *client,
                                              const char    *text,
                                              FepGAttribute *attr);
+void         fep_g_client_update_cursor_text
+                                            (FepGClient    *client,
+                                             gsize          start,
+                                             gsize          end,
+                                             const char    *text,
+                                             FepGAttribute *attr);
 void         fep_g_client_set_status_text   (FepGClient    *client,
                                              const char    *text,
                                              FepGAttribute *attr);
@@ -81,11 +94,24 @@ void         fep_g_client_send_text         (FepGClient    *client,
 void         fep_g_client_send_data         (FepGClient    *client,
                                              const char    *data,
                                              gsize          length);
+void         fep_g_client_send_bytes        (FepGClient    *client,
+                                             GBytes        *bytes);
 void         fep_g_client_forward_key_event (FepGClient    *client,
                                              guint          keyval,
                                              guint          modifiers);
+void         fep_g_client_begin             (FepGClient    *client);
+void         fep_g_client_commit            (FepGClient    *client);
 gint         fep_g_client_get_poll_fd       (FepGClient    *client);
 gboolean     fep_g_client_dispatch          (FepGClient    *client);
+GSource *    fep_g_client_create_source     (FepGClient    *client);
+void         fep_g_client_flush_async       (FepGClient    *client,
+                                             int            io_priority,
+                                             GCancellable  *cancellable,
+                                             GAsyncReadyCallback callback,
+                                             gpointer       user_data);
+gboolean     fep_g_client_flush_finish      (FepGClient    *client,
+                                             GAsyncResult  *res,
+                                             GError       **error);
 
 G_END_DECLS
 
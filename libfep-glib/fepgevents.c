@@ -53,6 +53,7 @@ fep_g_event_copy (const FepGEvent *event)
 					event->key.source_length);
       break;
     case FEP_G_EVENT_TYPE_RESIZED:
+    case FEP_G_EVENT_TYPE_MOUSE:
       break;
     }
   return new_event;
@@ -69,6 +70,7 @@ fep_g_event_free (FepGEvent *event)
       g_free (event->key.source);
       break;
     case FEP_G_EVENT_TYPE_RESIZED:
+    case FEP_G_EVENT_TYPE_MOUSE:
       break;
     }
   g_slice_free (FepGEvent, event);
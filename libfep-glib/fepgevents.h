@@ -29,11 +29,13 @@ G_BEGIN_DECLS
  * @FEP_G_EVENT_TYPE_NOTHING: Nothing happend; used to indicate error
  * @FEP_G_EVENT_TYPE_KEY_PRESS: Key is pressed
  * @FEP_G_EVENT_TYPE_RESIZED: Window is resized
+ * @FEP_G_EVENT_TYPE_MOUSE: Mouse is clicked or moved
  */
 typedef enum {
   FEP_G_EVENT_TYPE_NOTHING = -1,
   FEP_G_EVENT_TYPE_KEY_PRESS = 0,
   FEP_G_EVENT_TYPE_RESIZED = 1,
+  FEP_G_EVENT_TYPE_MOUSE = 2,
 } FepGEventType;
 
 typedef struct _FepGEventAny FepGEventAny;
@@ -84,6 +86,28 @@ struct _FepGEventResize
   guint rows;
 };
 
+typedef struct _FepGEventMouse FepGEventMouse;
+
+/**
+ * FepGEventMouse:
+ * @type: type of the event
+ * @action: a #FepMouseAction
+ * @button: button number, as in #FepEventMouse
+ * @modifiers: modifier mask
+ * @col: column, counted from 0
+ * @row: row, counted from 0
+ */
+struct _FepGEventMouse
+{
+  /*< public >*/
+  FepGEventType type;
+  guint action;
+  guint button;
+  guint modifiers;
+  guint col;
+  guint row;
+};
+
 typedef union _FepGEvent FepGEvent;
 
 /**
@@ -97,6 +121,7 @@ union _FepGEvent
   FepGEventAny any;
   FepGEventKey key;
   FepGEventResize resize;
+  FepGEventMouse mouse;
 };
 
 #define FEP_TYPE_G_EVENT fep_g_event_get_type ();
@@ -19,7 +19,12 @@
 #include <libfep/private.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <byteswap.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -35,13 +40,50 @@ char *program_name = "libfep";
  * @short_description: Client connection to FEP server
  */
 
+/* An encoded message queued for the I/O thread */
+struct _FepClientFrame
+{
+  struct _FepClientFrame *next;
+  size_t length;
+  char data[];
+};
+typedef struct _FepClientFrame FepClientFrame;
+
 struct _FepClient
 {
   int control;
+  FepShm *shm;
+  FepClientFlags flags;
+  int priority;
   FepEventFilter filter;
   void *filter_data;
   bool filter_running;
-  FepList *messages;
+  /* encoded messages not yet written: those sent from the event
+     filter, inside fep_client_dispatch_pending, or with
+     FEP_CLIENT_NONBLOCK */
+  FepString outbuf;
+  bool batching;
+  /* offset plus one of the buffered message of each coalescing
+     command, since the last flush */
+  size_t coalesce[FEP_CONTROL_COMMAND_LAST];
+  /* data read from the control socket but not yet decoded */
+  FepString inbuf;
+  /* timestamps of the key event being processed, in microseconds */
+  uint32_t read_time;
+  uint32_t server_time;
+  uint32_t filter_time;
+  bool key_handled;
+  /* protects filter, filter_data, executor, executor_data, and stats */
+  pthread_mutex_t lock;
+  FepExecutor executor;
+  void *executor_data;
+  FepClientStats stats;
+  /* with FEP_CLIENT_THREAD, the I/O thread and the frames to be
+     written by it, pushed by any thread in LIFO order */
+  pthread_t thread;
+  FepClientFrame *frames;
+  int wakeup[2];
+  bool stopping;
 };
 
 static const FepAttribute empty_attr =
@@ -50,6 +92,448 @@ static const FepAttribute empty_attr =
     .value = 0,
   };
 
+static int _fep_client_handle_request (FepClient         *client,
+                                       FepControlMessage *request);
+
+static int
+_fep_client_write_control_message (FepClient         *client,
+                                   FepControlMessage *message)
+{
+  if (client->shm)
+    return _fep_shm_write_control_message (client->shm, message, true);
+  return _fep_write_control_message (client->control, message);
+}
+
+/* Read a message through the input buffer.  Returns 1 if no complete
+   message is available and BLOCK is false.  */
+static int
+_fep_client_read_buffered (FepClient         *client,
+                           FepControlMessage *message,
+                           bool               block)
+{
+  FepString *buf = &client->inbuf;
+
+  while (true)
+    {
+      char data[BUFSIZ];
+      ssize_t length = _fep_control_message_frame_length (buf->str, buf->len);
+
+      if (length < 0)
+	return -1;
+      if (length > 0)
+	{
+	  int retval = _fep_control_message_decode (message, buf->str, length);
+
+	  memmove (buf->str, buf->str + length, buf->len - length);
+	  buf->len -= length;
+	  return retval;
+	}
+
+      length = recv (client->control, data, sizeof(data),
+		     block ? 0 : MSG_DONTWAIT);
+      if (length < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (!block && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return 1;
+	  fep_log (FEP_LOG_LEVEL_WARNING,
+		   "failed to read from %d: %s",
+		   client->control, strerror (errno));
+	  return -1;
+	}
+      if (length == 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_DEBUG,
+		   "connection %d closed",
+		   client->control);
+	  return -1;
+	}
+      _fep_string_append (buf, data, length);
+    }
+}
+
+static int
+_fep_client_read_control_message (FepClient         *client,
+                                  FepControlMessage *message,
+                                  bool               block)
+{
+  int retval;
+
+  if (client->shm)
+    retval = _fep_shm_read_control_message (client->shm, message, block);
+  else
+    retval = _fep_client_read_buffered (client, message, block);
+  if (retval == 0)
+    client->read_time = _fep_get_monotonic_time ();
+  return retval;
+}
+
+/* Write out the messages in the output buffer.  If BLOCK is false,
+   stop when the socket or the shared memory ring is full.  Returns 1
+   if some data remain, 0 if the buffer is drained, or -1 on error.  */
+static int
+_fep_client_flush_outbuf (FepClient *client, bool block)
+{
+  FepString *buf = &client->outbuf;
+  size_t total = 0;
+  int retval = 0;
+
+  while (total < buf->len)
+    {
+      if (client->shm)
+	{
+	  uint32_t len;
+
+	  /* each message is prefixed with its length */
+	  memcpy (&len, buf->str + total, sizeof(uint32_t));
+	  retval = _fep_shm_write_frame (client->shm,
+					 buf->str + total + sizeof(uint32_t),
+					 len,
+					 block);
+	  if (retval != 0)
+	    break;
+	  total += sizeof(uint32_t) + len;
+	}
+      else
+	{
+	  ssize_t bytes_sent = send (client->control,
+				     buf->str + total,
+				     buf->len - total,
+				     block ? 0 : MSG_DONTWAIT);
+	  if (bytes_sent < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+		  retval = 1;
+		  break;
+		}
+	      fep_log (FEP_LOG_LEVEL_WARNING,
+		       "failed to write to %d: %s",
+		       client->control, strerror (errno));
+	      retval = -1;
+	      break;
+	    }
+	  total += bytes_sent;
+	}
+    }
+
+  if (total > 0)
+    {
+      memmove (buf->str, buf->str + total, buf->len - total);
+      buf->len -= total;
+      memset (client->coalesce, 0, sizeof(client->coalesce));
+    }
+  return retval;
+}
+
+/* Wake up the I/O thread blocked in poll().  */
+static void
+_fep_client_wakeup (FepClient *client)
+{
+  char c = 0;
+
+  while (write (client->wakeup[1], &c, 1) < 0 && errno == EINTR)
+    ;
+}
+
+/* Hand MESSAGE to the I/O thread.  This is lock-free: the frame is
+   pushed on a stack, which the I/O thread takes at once and reverses
+   to write the frames in the order they were pushed.  */
+static int
+_fep_client_push_frame (FepClient         *client,
+                        FepControlMessage *message)
+{
+  FepClientFrame *frame, *head;
+  FepString buf;
+
+  memset (&buf, 0, sizeof(FepString));
+  _fep_control_message_encode (message, &buf);
+  frame = xmalloc (sizeof(FepClientFrame) + buf.len);
+  frame->length = buf.len;
+  memcpy (frame->data, buf.str, buf.len);
+  free (buf.str);
+
+  /* FRAME may be written and freed as soon as it is pushed */
+  head = __atomic_load_n (&client->frames, __ATOMIC_RELAXED);
+  do
+    frame->next = head;
+  while (!__atomic_compare_exchange_n (&client->frames,
+				       &head,
+				       frame,
+				       true,
+				       __ATOMIC_RELEASE,
+				       __ATOMIC_RELAXED));
+  _fep_log_control_message ("queue", message);
+
+  /* the I/O thread has been woken up for the other frames */
+  if (head == NULL)
+    _fep_client_wakeup (client);
+  return 0;
+}
+
+/* Write the frames pushed by _fep_client_push_frame, from the I/O
+   thread.  */
+static int
+_fep_client_write_frames (FepClient *client)
+{
+  FepClientFrame *frames, *reversed = NULL;
+  int retval = 0;
+
+  frames = __atomic_exchange_n (&client->frames, NULL, __ATOMIC_ACQUIRE);
+  while (frames)
+    {
+      FepClientFrame *next = frames->next;
+      frames->next = reversed;
+      reversed = frames;
+      frames = next;
+    }
+
+  while (reversed)
+    {
+      FepClientFrame *next = reversed->next;
+
+      if (retval == 0)
+	{
+	  if (client->shm)
+	    retval = _fep_shm_write_frame (client->shm,
+					   reversed->data,
+					   reversed->length,
+					   true);
+	  else
+	    {
+	      size_t total = 0;
+
+	      while (total < reversed->length)
+		{
+		  ssize_t bytes_sent = send (client->control,
+					     reversed->data + total,
+					     reversed->length - total,
+					     0);
+		  if (bytes_sent < 0)
+		    {
+		      if (errno == EINTR)
+			continue;
+		      fep_log (FEP_LOG_LEVEL_WARNING,
+			       "failed to write to %d: %s",
+			       client->control, strerror (errno));
+		      retval = -1;
+		      break;
+		    }
+		  total += bytes_sent;
+		}
+	    }
+	}
+      free (reversed);
+      reversed = next;
+    }
+
+  return retval;
+}
+
+static void *
+_fep_client_thread (void *data)
+{
+  FepClient *client = data;
+  struct pollfd pfds[2];
+
+  pfds[0].fd = fep_client_get_poll_fd (client);
+  pfds[0].events = POLLIN;
+  pfds[1].fd = client->wakeup[0];
+  pfds[1].events = POLLIN;
+
+  while (!__atomic_load_n (&client->stopping, __ATOMIC_ACQUIRE))
+    {
+      if (poll (pfds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
+
+      if (pfds[1].revents & POLLIN)
+	{
+	  char buf[64];
+	  while (read (client->wakeup[0], buf, sizeof(buf)) > 0)
+	    ;
+	}
+
+      if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR))
+	{
+	  if (fep_client_dispatch (client) < 0)
+	    break;
+	}
+
+      if (_fep_client_write_frames (client) < 0)
+	break;
+    }
+
+  return NULL;
+}
+
+static int
+_fep_client_start_thread (FepClient *client)
+{
+  if (pipe (client->wakeup) < 0)
+    return -1;
+  fcntl (client->wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl (client->wakeup[1], F_SETFL, O_NONBLOCK);
+  /* frames pushed while the thread waits for the ring are written
+     without waiting for the server */
+  if (client->shm)
+    _fep_shm_set_wakeup_fd (client->shm, client->wakeup[0]);
+
+  if (pthread_create (&client->thread, NULL, _fep_client_thread, client) != 0)
+    {
+      close (client->wakeup[0]);
+      close (client->wakeup[1]);
+      return -1;
+    }
+  return 0;
+}
+
+/* Encode MESSAGE at the end of the output buffer, replacing the
+   buffered message it supersedes.  */
+static void
+_fep_client_buffer_control_message (FepClient         *client,
+                                    FepControlMessage *message)
+{
+  FepString *buf = &client->outbuf;
+  size_t offset;
+
+  if (_fep_control_command_coalesces (message->command)
+      && client->coalesce[message->command] > 0)
+    {
+      size_t length;
+      int i;
+
+      offset = client->coalesce[message->command] - 1;
+      if (client->shm)
+	{
+	  uint32_t len;
+
+	  memcpy (&len, buf->str + offset, sizeof(uint32_t));
+	  length = sizeof(uint32_t) + len;
+	}
+      else
+	length = _fep_control_message_frame_length (buf->str + offset,
+						    buf->len - offset);
+      memmove (buf->str + offset,
+	       buf->str + offset + length,
+	       buf->len - offset - length);
+      buf->len -= length;
+      for (i = 0; i < FEP_CONTROL_COMMAND_LAST; i++)
+	if (client->coalesce[i] > offset + 1)
+	  client->coalesce[i] -= length;
+      _fep_log_control_message ("coalesce", message);
+    }
+
+  offset = buf->len;
+  if (_fep_control_command_coalesces (message->command))
+    client->coalesce[message->command] = offset + 1;
+  /* a delta needs the cursor text it applies to */
+  if (message->command == FEP_CONTROL_SET_CURSOR_TEXT_DELTA)
+    client->coalesce[FEP_CONTROL_SET_CURSOR_TEXT] = 0;
+
+  if (client->shm)
+    {
+      /* the shared memory ring needs the length of each message */
+      uint32_t len = 0;
+
+      _fep_string_append (buf, (char *) &len, sizeof(uint32_t));
+      _fep_control_message_encode (message, buf);
+      len = buf->len - offset - sizeof(uint32_t);
+      memcpy (buf->str + offset, &len, sizeof(uint32_t));
+    }
+  else
+    _fep_control_message_encode (message, buf);
+  _fep_log_control_message ("queue", message);
+}
+
+/* Send MESSAGE.  It is buffered if called from the event filter or
+   fep_client_dispatch_pending, and written out afterwards.  With
+   FEP_CLIENT_NONBLOCK, the buffer is written as far as possible
+   without blocking.  */
+static int
+_fep_client_send_control_message (FepClient         *client,
+                                  FepControlMessage *message)
+{
+  if (client->flags & FEP_CLIENT_THREAD)
+    return _fep_client_push_frame (client, message);
+
+  if (!(client->flags & FEP_CLIENT_NONBLOCK)
+      && !client->filter_running
+      && !client->batching
+      && client->outbuf.len == 0)
+    return _fep_client_write_control_message (client, message);
+
+  _fep_client_buffer_control_message (client, message);
+
+  if (client->filter_running || client->batching)
+    return 0;
+  return _fep_client_flush_outbuf (client,
+				   !(client->flags & FEP_CLIENT_NONBLOCK))
+    < 0 ? -1 : 0;
+}
+
+static void
+_fep_client_register (FepClient *client)
+{
+  FepControlMessage message;
+
+  _fep_control_message_init (&message, FEP_CONTROL_REGISTER);
+  _fep_control_message_write_uint32_arg (&message, 0, client->priority);
+  _fep_control_message_write_uint32_arg (&message, 1, client->flags);
+
+  _fep_client_send_control_message (client, &message);
+  _fep_control_message_free_args (&message);
+}
+
+static void
+_fep_client_setup_shm (FepClient *client)
+{
+  FepControlMessage message;
+  int fds[FEP_SHM_N_FDS];
+  uint32_t intval = 0;
+
+  _fep_control_message_init (&message, FEP_CONTROL_SETUP_SHM);
+  if (_fep_write_control_message (client->control, &message) < 0)
+    return;
+
+  /* The server may send requests before it handles SETUP_SHM. */
+  while (true)
+    {
+      if (_fep_read_control_message (client->control, &message) < 0)
+	return;
+
+      if (message.command == FEP_CONTROL_RESPONSE)
+	break;
+
+      _fep_client_handle_request (client, &message);
+      _fep_control_message_free_args (&message);
+    }
+
+  if (message.n_args < 2
+      || message.args[0].len != 1
+      || *message.args[0].str != FEP_CONTROL_SETUP_SHM
+      || _fep_control_message_read_uint32_arg (&message, 1, &intval) < 0
+      || intval == 0)
+    {
+      _fep_control_message_free_args (&message);
+      fep_log (FEP_LOG_LEVEL_INFO,
+	       "server refused shared memory transport");
+      return;
+    }
+  _fep_control_message_free_args (&message);
+
+  if (_fep_receive_fds (client->control, fds, FEP_SHM_N_FDS) < 0)
+    return;
+
+  client->shm = _fep_shm_new (fds, false, client->control);
+}
+
 /**
  * fep_client_open:
  * @address: (allow-none): socket address of the FEP server
@@ -62,6 +546,32 @@ static const FepAttribute empty_attr =
  */
 FepClient *
 fep_client_open (const char *address)
+{
+  return fep_client_open_full (address, FEP_CLIENT_NONE);
+}
+
+/**
+ * fep_client_open_full:
+ * @address: (allow-none): socket address of the FEP server
+ * @flags: a #FepClientFlags
+ *
+ * Connect to the FEP server running at @address, like
+ * fep_client_open().  If @flags contains %FEP_CLIENT_SHM, the client
+ * asks the server to exchange messages through shared memory instead
+ * of the control socket; if the server refuses, the control socket is
+ * used as usual.  If @flags contains %FEP_CLIENT_OBSERVER, the client
+ * is only notified of key events.  If @flags contains
+ * %FEP_CLIENT_NONBLOCK, requests are buffered instead of blocking
+ * when the server is slow to read them; see fep_client_flush().  If
+ * @flags contains %FEP_CLIENT_THREAD, a background thread exchanges
+ * messages with the server, and the other functions may be called
+ * from any thread; fep_client_dispatch() and fep_client_flush() must
+ * not be called in that case.
+ *
+ * Returns: a new #FepClient.
+ */
+FepClient *
+fep_client_open_full (const char *address, FepClientFlags flags)
 {
   FepClient *client;
   struct sockaddr_un sun;
@@ -85,7 +595,7 @@ fep_client_open (const char *address)
 
   client = xzalloc (sizeof(FepClient));
   client->filter_running = false;
-  client->messages = NULL;
+  pthread_mutex_init (&client->lock, NULL);
 
   memset (&sun, 0, sizeof(struct sockaddr_un));
   sun.sun_family = AF_UNIX;
@@ -96,6 +606,7 @@ fep_client_open (const char *address)
   client->control = socket (AF_UNIX, SOCK_STREAM, 0);
   if (client->control < 0)
     {
+      pthread_mutex_destroy (&client->lock);
       free (client);
       return NULL;
     }
@@ -106,10 +617,30 @@ fep_client_open (const char *address)
   if (retval < 0)
     {
       close (client->control);
+      pthread_mutex_destroy (&client->lock);
       free (client);
       return NULL;
     }
 
+  /* the I/O thread is started last, so the setup below is done
+     synchronously */
+  client->flags = flags & ~FEP_CLIENT_THREAD;
+  if (flags & FEP_CLIENT_SHM)
+    _fep_client_setup_shm (client);
+  if (flags & FEP_CLIENT_OBSERVER)
+    _fep_client_register (client);
+
+  if (flags & FEP_CLIENT_THREAD)
+    {
+      if (_fep_client_start_thread (client) < 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_WARNING, "can't start I/O thread");
+	  fep_client_close (client);
+	  return NULL;
+	}
+      client->flags |= FEP_CLIENT_THREAD;
+    }
+
   return client;
 }
 
@@ -128,15 +659,44 @@ fep_client_set_cursor_text (FepClient    *client,
 {
   FepControlMessage message;
 
-  message.command = FEP_CONTROL_SET_CURSOR_TEXT;
-  _fep_control_message_alloc_args (&message, 2);
+  _fep_control_message_init (&message, FEP_CONTROL_SET_CURSOR_TEXT);
   _fep_control_message_write_string_arg (&message, 0, text, strlen (text) + 1);
   _fep_control_message_write_attribute_arg (&message, 1, attr ? attr : &empty_attr);
 
-  if (client->filter_running)
-    client->messages = _fep_append_control_message (client->messages, &message);
-  else
-    _fep_write_control_message (client->control, &message);
+  _fep_client_send_control_message (client, &message);
+  _fep_control_message_free_args (&message);
+}
+
+/**
+ * fep_client_update_cursor_text:
+ * @client: a #FepClient
+ * @start: byte offset where the change starts
+ * @end: byte offset where the change ends
+ * @text: text replacing the bytes from @start to @end
+ * @attr: a #FepAttribute applied to the whole cursor text
+ *
+ * Request to replace bytes from @start to @end of the cursor text last
+ * set by @client with @text, as if fep_client_set_cursor_text() were
+ * called with the result.  Only the change is sent to the server, and
+ * only the changed part is redrawn, which is cheaper for long cursor
+ * text.  Both offsets must be on UTF-8 character boundaries.
+ */
+void
+fep_client_update_cursor_text (FepClient    *client,
+                               size_t        start,
+                               size_t        end,
+                               const char   *text,
+                               FepAttribute *attr)
+{
+  FepControlMessage message;
+
+  _fep_control_message_init (&message, FEP_CONTROL_SET_CURSOR_TEXT_DELTA);
+  _fep_control_message_write_uint32_arg (&message, 0, start);
+  _fep_control_message_write_uint32_arg (&message, 1, end);
+  _fep_control_message_write_string_arg (&message, 2, text, strlen (text));
+  _fep_control_message_write_attribute_arg (&message, 3, attr ? attr : &empty_attr);
+
+  _fep_client_send_control_message (client, &message);
   _fep_control_message_free_args (&message);
 }
 
@@ -155,15 +715,11 @@ fep_client_set_status_text (FepClient    *client,
 {
   FepControlMessage message;
 
-  message.command = FEP_CONTROL_SET_STATUS_TEXT;
-  _fep_control_message_alloc_args (&message, 2);
+  _fep_control_message_init (&message, FEP_CONTROL_SET_STATUS_TEXT);
   _fep_control_message_write_string_arg (&message, 0, text, strlen (text) + 1);
   _fep_control_message_write_attribute_arg (&message, 1, attr ? attr : &empty_attr);
 
-  if (client->filter_running)
-    client->messages = _fep_append_control_message (client->messages, &message);
-  else
-    _fep_write_control_message (client->control, &message);
+  _fep_client_send_control_message (client, &message);
   _fep_control_message_free_args (&message);
 }
 
@@ -181,14 +737,10 @@ fep_client_send_text (FepClient *client, const char *text)
 {
   FepControlMessage message;
 
-  message.command = FEP_CONTROL_SEND_TEXT;
-  _fep_control_message_alloc_args (&message, 1);
+  _fep_control_message_init (&message, FEP_CONTROL_SEND_TEXT);
   _fep_control_message_write_string_arg (&message, 0, text, strlen (text) + 1);
 
-  if (client->filter_running)
-    client->messages = _fep_append_control_message (client->messages, &message);
-  else
-    _fep_write_control_message (client->control, &message);
+  _fep_client_send_control_message (client, &message);
   _fep_control_message_free_args (&message);
 }
 
@@ -205,14 +757,10 @@ fep_client_send_data (FepClient *client, const char *data, size_t length)
 {
   FepControlMessage message;
 
-  message.command = FEP_CONTROL_SEND_DATA;
-  _fep_control_message_alloc_args (&message, 1);
+  _fep_control_message_init (&message, FEP_CONTROL_SEND_DATA);
   _fep_control_message_write_string_arg (&message, 0, data, length);
 
-  if (client->filter_running)
-    client->messages = _fep_append_control_message (client->messages, &message);
-  else
-    _fep_write_control_message (client->control, &message);
+  _fep_client_send_control_message (client, &message);
   _fep_control_message_free_args (&message);
 }
 
@@ -231,15 +779,115 @@ fep_client_forward_key_event (FepClient      *client,
 {
   FepControlMessage message;
 
-  message.command = FEP_CONTROL_FORWARD_KEY_EVENT;
-  _fep_control_message_alloc_args (&message, 2);
+  _fep_control_message_init (&message, FEP_CONTROL_FORWARD_KEY_EVENT);
   _fep_control_message_write_uint32_arg (&message, 0, keyval);
   _fep_control_message_write_uint32_arg (&message, 1, modifiers);
 
-  if (client->filter_running)
-    client->messages = _fep_append_control_message (client->messages, &message);
-  else
-    _fep_write_control_message (client->control, &message);
+  _fep_client_send_control_message (client, &message);
+  _fep_control_message_free_args (&message);
+}
+
+/**
+ * fep_client_set_priority:
+ * @client: a #FepClient
+ * @priority: priority of @client
+ *
+ * Set the priority of @client among the clients receiving key events.
+ * The server sends a key event to clients with higher priority first
+ * and stops at the first client whose event filter returns non-zero.
+ * The default priority is 0.
+ */
+void
+fep_client_set_priority (FepClient *client, int priority)
+{
+  pthread_mutex_lock (&client->lock);
+  client->priority = priority;
+  pthread_mutex_unlock (&client->lock);
+  _fep_client_register (client);
+}
+
+/**
+ * fep_client_subscribe_keys:
+ * @client: a #FepClient
+ * @flags: a #FepKeySubscriptionFlags
+ * @patterns: an array of #FepKeyPattern
+ * @n_patterns: length of @patterns
+ *
+ * Tell the server which key events @client is interested in.  Other
+ * keys are sent to the child process without asking @client, which
+ * saves a round trip per key.  By default, all keys are delivered.
+ * For example, an input method which is turned off may only subscribe
+ * to the key turning it on.
+ * Mouse events are only delivered if @flags contains
+ * %FEP_KEY_SUBSCRIBE_MOUSE.
+ */
+void
+fep_client_subscribe_keys (FepClient              *client,
+                           FepKeySubscriptionFlags flags,
+                           const FepKeyPattern    *patterns,
+                           size_t                  n_patterns)
+{
+  FepControlMessage message;
+  uint32_t *data;
+  size_t i;
+
+  data = xcalloc (n_patterns, 3 * sizeof(uint32_t));
+  for (i = 0; i < n_patterns; i++)
+    {
+      data[3 * i] = patterns[i].keyval;
+      data[3 * i + 1] = patterns[i].modifiers;
+      data[3 * i + 2] = patterns[i].modifiers_mask;
+#ifdef WORDS_BIGENDIAN
+      data[3 * i] = bswap_32 (data[3 * i]);
+      data[3 * i + 1] = bswap_32 (data[3 * i + 1]);
+      data[3 * i + 2] = bswap_32 (data[3 * i + 2]);
+#endif
+    }
+
+  _fep_control_message_init (&message, FEP_CONTROL_SUBSCRIBE_KEYS);
+  _fep_control_message_write_uint32_arg (&message, 0, flags);
+  _fep_control_message_write_string_arg (&message, 1, (const char *) data,
+					 n_patterns * 3 * sizeof(uint32_t));
+  free (data);
+
+  _fep_client_send_control_message (client, &message);
+  _fep_control_message_free_args (&message);
+}
+
+/**
+ * fep_client_begin:
+ * @client: a #FepClient
+ *
+ * Start a group of requests which the server applies at once, when
+ * fep_client_commit() is called.  This avoids flicker when updating
+ * several things at a time, e.g. sending text and clearing the cursor
+ * text.  Calls can be nested.
+ */
+void
+fep_client_begin (FepClient *client)
+{
+  FepControlMessage message;
+
+  _fep_control_message_init (&message, FEP_CONTROL_BEGIN);
+
+  _fep_client_send_control_message (client, &message);
+  _fep_control_message_free_args (&message);
+}
+
+/**
+ * fep_client_commit:
+ * @client: a #FepClient
+ *
+ * Finish a group of requests started with fep_client_begin().
+ */
+void
+fep_client_commit (FepClient *client)
+{
+  FepControlMessage message;
+
+  _fep_control_message_init (&message, FEP_CONTROL_COMMIT);
+
+  _fep_client_send_control_message (client, &message);
   _fep_control_message_free_args (&message);
 }
 
@@ -257,24 +905,158 @@ fep_client_set_event_filter (FepClient *client,
 			     FepEventFilter filter,
 			     void *data)
 {
+  pthread_mutex_lock (&client->lock);
   client->filter = filter;
   client->filter_data = data;
+  pthread_mutex_unlock (&client->lock);
+}
+
+/**
+ * fep_client_set_executor:
+ * @client: a #FepClient
+ * @executor: (allow-none): an executor function
+ * @data: user supplied data
+ *
+ * Set a function which runs the event filter on behalf of the I/O
+ * thread of a client opened with %FEP_CLIENT_THREAD, e.g. by
+ * scheduling it on the main loop of the application.  @executor must
+ * eventually call the function passed to it, exactly once; the I/O
+ * thread waits for it.  If @executor is %NULL, the event filter is
+ * called on the I/O thread.
+ */
+void
+fep_client_set_executor (FepClient  *client,
+                         FepExecutor executor,
+                         void       *data)
+{
+  pthread_mutex_lock (&client->lock);
+  client->executor = executor;
+  client->executor_data = data;
+  pthread_mutex_unlock (&client->lock);
 }
 
 /**
  * fep_client_get_poll_fd:
  * @client: a #FepClient
  *
- * Get the file descriptor of the control socket which can be used by poll().
+ * Get the file descriptor of the control socket which can be used by
+ * poll().  If the shared memory transport is in use, this is the
+ * descriptor signalled when a message arrives.
  *
  * Returns: a file descriptor
  */
 int
 fep_client_get_poll_fd (FepClient *client)
 {
+  if (client->shm)
+    return _fep_shm_get_poll_fd (client->shm);
   return client->control;
 }
 
+/**
+ * fep_client_flush:
+ * @client: a #FepClient
+ *
+ * Write out the messages buffered by a client opened with
+ * %FEP_CLIENT_NONBLOCK, as far as possible without blocking.
+ *
+ * Returns: 0 if all messages are written, 1 if some remain, or -1 on
+ * failure.
+ */
+int
+fep_client_flush (FepClient *client)
+{
+  return _fep_client_flush_outbuf (client, false);
+}
+
+/**
+ * fep_client_get_poll_events:
+ * @client: a #FepClient
+ *
+ * Get the events to poll for on the file descriptor returned by
+ * fep_client_get_poll_fd().  This includes %POLLOUT when a client
+ * opened with %FEP_CLIENT_NONBLOCK has buffered messages; call
+ * fep_client_flush() when the descriptor becomes writable.  With the
+ * shared memory transport there is no descriptor to wait for space,
+ * so %POLLOUT is never included; buffered messages are written by
+ * fep_client_dispatch() or by calling fep_client_flush() later.
+ *
+ * Returns: a mask of poll() events
+ */
+int
+fep_client_get_poll_events (FepClient *client)
+{
+  if (client->outbuf.len > 0 && !client->shm)
+    return POLLIN | POLLOUT;
+  return POLLIN;
+}
+
+struct _FepFilterCall
+{
+  FepEventFilter filter;
+  void *filter_data;
+  FepEvent *event;
+  int retval;
+  bool done;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+typedef struct _FepFilterCall FepFilterCall;
+
+static void
+_fep_client_run_filter_call (void *data)
+{
+  FepFilterCall *call = data;
+  int retval = call->filter (call->event, call->filter_data);
+
+  pthread_mutex_lock (&call->mutex);
+  call->retval = retval;
+  call->done = true;
+  pthread_cond_signal (&call->cond);
+  pthread_mutex_unlock (&call->mutex);
+}
+
+/* Call the event filter directly or through the executor.  Returns
+   the value of the filter, or 0 if there is no filter.  */
+static int
+_fep_client_call_filter (FepClient *client, FepEvent *event)
+{
+  FepFilterCall call;
+
+  pthread_mutex_lock (&client->lock);
+  call.filter = client->filter;
+  call.filter_data = client->filter_data;
+  if (call.filter && client->executor)
+    {
+      FepExecutor executor = client->executor;
+      void *executor_data = client->executor_data;
+
+      pthread_mutex_unlock (&client->lock);
+
+      call.event = event;
+      call.retval = 0;
+      call.done = false;
+      pthread_mutex_init (&call.mutex, NULL);
+      pthread_cond_init (&call.cond, NULL);
+
+      executor (_fep_client_run_filter_call, &call, executor_data);
+
+      pthread_mutex_lock (&call.mutex);
+      while (!call.done)
+	pthread_cond_wait (&call.cond, &call.mutex);
+      pthread_mutex_unlock (&call.mutex);
+
+      pthread_mutex_destroy (&call.mutex);
+      pthread_cond_destroy (&call.cond);
+      return call.retval;
+    }
+  pthread_mutex_unlock (&client->lock);
+
+  if (call.filter == NULL)
+    return 0;
+  return call.filter (event, call.filter_data);
+}
+
 static void
 command_key_event (FepClient *client,
 		   FepControlMessage *request,
@@ -300,24 +1082,81 @@ command_key_event (FepClient *client,
     }
   event.modifiers = intval;
 
+  retval = _fep_control_message_read_uint32_arg (request, 3,
+						 &client->server_time);
+  if (retval < 0)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "can't read timestamp");
+      goto out;
+    }
+
  out:
-  response->command = FEP_CONTROL_RESPONSE;
-  _fep_control_message_alloc_args (response, 2);
+  client->filter_time = 0;
+  client->key_handled = false;
+  _fep_control_message_init (response, FEP_CONTROL_RESPONSE);
   _fep_control_message_write_uint8_arg (response, 0, FEP_CONTROL_KEY_EVENT);
 
-  intval = retval;
-  if (retval == 0 && client->filter)
+  /* a request which can't be decoded is not handled */
+  intval = 0;
+  if (retval == 0)
     {
+      uint32_t start_time;
+
       event.event.type = FEP_KEY_PRESS;
       event.source = request->args[2].str;
       event.source_length = request->args[2].len;
-      intval = client->filter ((FepEvent *) &event, client->filter_data);
-      _fep_control_message_write_uint32_arg (response, 1, intval);
+
+      start_time = _fep_get_monotonic_time ();
+      intval = _fep_client_call_filter (client, (FepEvent *) &event);
+      client->filter_time = _fep_get_monotonic_time () - start_time;
+      client->key_handled = intval != 0;
     }
+  /* If the key is not handled, the server passes the original input
+     to the child process. */
+  _fep_control_message_write_uint32_arg (response, 1, intval);
+}
+
+static void
+command_key_notify (FepClient         *client,
+                    FepControlMessage *request,
+                    FepControlMessage *response)
+{
+  FepEventKey event;
+  uint32_t keyval, modifiers;
 
-  /* If key is not handled, send back the original input to the server. */
-  if (intval == 0)
-    fep_client_send_data (client, request->args[2].str, request->args[2].len);
+  if (_fep_control_message_read_uint32_arg (request, 0, &keyval) == 0
+      && _fep_control_message_read_uint32_arg (request, 1, &modifiers) == 0)
+    {
+      event.event.type = FEP_KEY_PRESS;
+      event.keyval = keyval;
+      event.modifiers = modifiers;
+      event.source = request->args[2].str;
+      event.source_length = request->args[2].len;
+      _fep_client_call_filter (client, (FepEvent *) &event);
+    }
+}
+
+static void
+command_mouse_event (FepClient         *client,
+                     FepControlMessage *request,
+                     FepControlMessage *response)
+{
+  FepEventMouse event;
+  uint32_t action, modifiers, col, row;
+
+  if (_fep_control_message_read_uint32_arg (request, 0, &action) == 0
+      && _fep_control_message_read_uint32_arg (request, 1, &modifiers) == 0
+      && _fep_control_message_read_uint32_arg (request, 2, &col) == 0
+      && _fep_control_message_read_uint32_arg (request, 3, &row) == 0)
+    {
+      event.event.type = FEP_MOUSE;
+      event.action = action >> 8;
+      event.button = action & 0xff;
+      event.modifiers = modifiers;
+      event.col = col;
+      event.row = row;
+      _fep_client_call_filter (client, (FepEvent *) &event);
+    }
 }
 
 static void
@@ -346,82 +1185,215 @@ command_resize_event (FepClient         *client,
   event.rows = intval;
 
  out:
-  response->command = FEP_CONTROL_RESPONSE;
-  _fep_control_message_alloc_args (response, 2);
+  _fep_control_message_init (response, FEP_CONTROL_RESPONSE);
   _fep_control_message_write_uint8_arg (response, 0, FEP_CONTROL_RESIZE_EVENT);
 
   intval = retval;
-  if (retval == 0 && client->filter)
+  if (retval == 0)
     {
       event.event.type = FEP_RESIZED;
-      intval = client->filter ((FepEvent *) &event, client->filter_data);
-      _fep_control_message_write_uint32_arg (response, 1, intval);
+      intval = _fep_client_call_filter (client, (FepEvent *) &event);
     }
+  _fep_control_message_write_uint32_arg (response, 1, intval);
+}
+
+static int
+stats_bucket (uint32_t usec)
+{
+  int i;
+
+  for (i = 0; usec >= 2 && i < FEP_CLIENT_STATS_N_BUCKETS - 1; i++)
+    usec >>= 1;
+  return i;
+}
+
+/* Account the key event whose response has just been sent.  */
+static void
+_fep_client_update_stats (FepClient *client)
+{
+  uint32_t now = _fep_get_monotonic_time ();
+
+  pthread_mutex_lock (&client->lock);
+  client->stats.n_key_events++;
+  if (client->key_handled)
+    client->stats.n_key_events_handled++;
+  client->stats.filter_time[stats_bucket (client->filter_time)]++;
+  client->stats.response_time[stats_bucket (now - client->read_time)]++;
+  client->stats.latency[stats_bucket (now - client->server_time)]++;
+  pthread_mutex_unlock (&client->lock);
+}
+
+static int
+_fep_client_handle_request (FepClient         *client,
+                            FepControlMessage *request)
+{
+  static const struct
+  {
+    void (*handler) (FepClient *client,
+		     FepControlMessage *request,
+		     FepControlMessage *response);
+    bool responds;
+  } handlers[FEP_CONTROL_COMMAND_LAST] =
+      {
+#define HANDLER_SERVER(NAME, name)
+#define HANDLER_CLIENT(NAME, name)			\
+	[FEP_CONTROL_##NAME] = { command_##name, true },
+#define HANDLER_NOTIFY(NAME, name)			\
+	[FEP_CONTROL_##NAME] = { command_##name, false },
+#define HANDLER_RESPONSE(NAME, name)
+#define FEP_CONTROL_COMMAND(NAME, name, value, direction,	\
+			    arg0, arg1, arg2, arg3, compact, coalesce)	\
+	HANDLER_##direction (NAME, name)
+#include <libfep/control.def>
+#undef FEP_CONTROL_COMMAND
+#undef HANDLER_SERVER
+#undef HANDLER_CLIENT
+#undef HANDLER_NOTIFY
+#undef HANDLER_RESPONSE
+      };
+  FepControlMessage response;
+
+  if (request->command >= FEP_CONTROL_COMMAND_LAST
+      || handlers[request->command].handler == NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "no handler defined for %d", request->command);
+      return -1;
+    }
+
+  client->filter_running = true;
+  handlers[request->command].handler (client, request, &response);
+  client->filter_running = false;
+
+  /* the response follows the messages sent by the handler; the
+     server keeps those aside until it gets the response */
+  if (handlers[request->command].responds)
+    {
+      _fep_client_send_control_message (client, &response);
+      _fep_control_message_free_args (&response);
+      if (request->command == FEP_CONTROL_KEY_EVENT)
+	_fep_client_update_stats (client);
+    }
+  else if (!client->batching && client->outbuf.len > 0)
+    return _fep_client_flush_outbuf (client,
+				     !(client->flags & FEP_CLIENT_NONBLOCK))
+      < 0 ? -1 : 0;
+
+  return 0;
 }
 
 /**
  * fep_client_dispatch:
  * @client: a #FepClient
  *
- * Dispatch a request from server.
+ * Dispatch a request from server.  Requests which have been read
+ * along with it are dispatched as well, since poll() would not report
+ * them.
  *
  * Returns: 0 on success, -1 on failure.
  */
 int
 fep_client_dispatch (FepClient *client)
 {
-  static const struct
-  {
-    FepControlCommand command;
-    void (*handler) (FepClient *client,
-		     FepControlMessage *request,
-		     FepControlMessage *response);
-  } handlers[] =
-      {
-	{ FEP_CONTROL_KEY_EVENT, command_key_event },
-	{ FEP_CONTROL_RESIZE_EVENT, command_resize_event },
-      };
-  FepControlMessage request, response;
+  FepControlMessage request;
   int retval;
-  int i;
 
-  retval = _fep_read_control_message (client->control, &request);
+  retval = _fep_client_read_control_message (client, &request, true);
   if (retval < 0)
     return -1;
+  /* spurious wakeup of the shared memory transport */
+  if (retval > 0)
+    return 0;
 
-  for (i = 0;
-       i < SIZEOF (handlers) && handlers[i].command != request.command;
-       i++)
-    ;
-  if (i == SIZEOF (handlers))
+  retval = _fep_client_handle_request (client, &request);
+  _fep_control_message_free_args (&request);
+
+  while (retval == 0
+	 && _fep_control_message_frame_length (client->inbuf.str,
+					       client->inbuf.len) > 0)
     {
+      retval = _fep_client_read_buffered (client, &request, false);
+      if (retval < 0)
+	return -1;
+      retval = _fep_client_handle_request (client, &request);
       _fep_control_message_free_args (&request);
-      fep_log (FEP_LOG_LEVEL_WARNING,
-	       "no handler defined for %d", request.command);
-      return -1;
     }
 
-  client->filter_running = true;
-  handlers[i].handler (client, &request, &response);
-  _fep_control_message_free_args (&request);
-  _fep_write_control_message (client->control, &response);
-  _fep_control_message_free_args (&response);
-  client->filter_running = false;
+  if (client->outbuf.len > 0 && _fep_client_flush_outbuf (client, false) < 0)
+    return -1;
 
-  /* flush queued messages during handler is executed */
-  while (client->messages)
-    {
-      FepList *_head = client->messages;
-      FepControlMessage *_message = _head->data;
+  return retval;
+}
 
-      client->messages = _head->next;
+/**
+ * fep_client_dispatch_pending:
+ * @client: a #FepClient
+ *
+ * Dispatch all requests from server which can be read without
+ * blocking.  Responses and other messages sent meanwhile are written
+ * at once at the end; with %FEP_CLIENT_NONBLOCK, what can't be
+ * written without blocking is left to fep_client_flush().
+ *
+ * Returns: the number of requests dispatched, or -1 on failure.
+ */
+int
+fep_client_dispatch_pending (FepClient *client)
+{
+  FepControlMessage request;
+  int n_dispatched = 0, retval;
 
-      _fep_write_control_message (client->control, _message);
-      _fep_control_message_free (_message);
-      free (_head);
+  client->batching = true;
+  while (true)
+    {
+      retval = _fep_client_read_control_message (client, &request, false);
+      if (retval != 0)
+	break;
+
+      retval = _fep_client_handle_request (client, &request);
+      _fep_control_message_free_args (&request);
+      if (retval < 0)
+	break;
+      n_dispatched++;
     }
+  client->batching = false;
 
-  return retval;
+  if (_fep_client_flush_outbuf (client,
+				!(client->flags & FEP_CLIENT_NONBLOCK)) < 0
+      || retval < 0)
+    return -1;
+
+  return n_dispatched;
+}
+
+/**
+ * fep_client_get_stats:
+ * @client: a #FepClient
+ * @r_stats: (out): a #FepClientStats
+ *
+ * Get the statistics of the key events processed by @client since it
+ * was opened or fep_client_reset_stats() was called.  This can be
+ * called from any thread.
+ */
+void
+fep_client_get_stats (FepClient *client, FepClientStats *r_stats)
+{
+  pthread_mutex_lock (&client->lock);
+  memcpy (r_stats, &client->stats, sizeof(FepClientStats));
+  pthread_mutex_unlock (&client->lock);
+}
+
+/**
+ * fep_client_reset_stats:
+ * @client: a #FepClient
+ *
+ * Clear the statistics of the key events processed by @client.
+ */
+void
+fep_client_reset_stats (FepClient *client)
+{
+  pthread_mutex_lock (&client->lock);
+  memset (&client->stats, 0, sizeof(FepClientStats));
+  pthread_mutex_unlock (&client->lock);
 }
 
 /**
@@ -429,10 +1401,28 @@ fep_client_dispatch (FepClient *client)
  * @client: a FepClient
  *
  * Close the control socket and release the memory allocated for @client.
+ * With %FEP_CLIENT_THREAD, this must not be called from the event
+ * filter.
  */
 void
 fep_client_close (FepClient *client)
 {
+  if (client->flags & FEP_CLIENT_THREAD)
+    {
+      __atomic_store_n (&client->stopping, true, __ATOMIC_RELEASE);
+      _fep_client_wakeup (client);
+      pthread_join (client->thread, NULL);
+      _fep_client_write_frames (client);
+      close (client->wakeup[0]);
+      close (client->wakeup[1]);
+    }
+  pthread_mutex_destroy (&client->lock);
+
+  _fep_client_flush_outbuf (client, true);
+  free (client->outbuf.str);
+  free (client->inbuf.str);
+  if (client->shm)
+    _fep_shm_free (client->shm);
   close (client->control);
   free (client);
 }
@@ -24,12 +24,14 @@
  * @FEP_NOTHING: Nothing happend; used to indicate error
  * @FEP_KEY_PRESS: Key is pressed
  * @FEP_RESIZED: Window is resized
+ * @FEP_MOUSE: Mouse is clicked or moved
  */
 typedef enum _FepEventType
   {
     FEP_NOTHING = -1,
     FEP_KEY_PRESS = 0,
-    FEP_RESIZED = 1
+    FEP_RESIZED = 1,
+    FEP_MOUSE = 2
   } FepEventType;
 
 /**
@@ -74,14 +76,157 @@ struct _FepEventResize
 };
 typedef struct _FepEventResize FepEventResize;
 
+/**
+ * FepMouseAction:
+ * @FEP_MOUSE_PRESS: A button is pressed, or the wheel is turned
+ * @FEP_MOUSE_RELEASE: A button is released
+ * @FEP_MOUSE_MOTION: The mouse is moved
+ */
+typedef enum _FepMouseAction
+  {
+    FEP_MOUSE_PRESS = 0,
+    FEP_MOUSE_RELEASE = 1,
+    FEP_MOUSE_MOTION = 2
+  } FepMouseAction;
+
+/**
+ * FepEventMouse:
+ * @event: base event struct
+ * @action: a #FepMouseAction
+ * @button: 1 to 3 for the left, middle, and right buttons, 4 to 7
+ *  for the wheel turned up, down, left, and right, 8 to 11 for the
+ *  other buttons, or 0 if unknown
+ * @modifiers: modifier mask
+ * @col: column, counted from 0
+ * @row: row, counted from 0
+ *
+ * A mouse report of the terminal, which is also passed to the child
+ * process.  Motion events read at once are coalesced into the last
+ * one.
+ */
+struct _FepEventMouse
+{
+  FepEvent event;
+  FepMouseAction action;
+  unsigned int button;
+  FepModifierType modifiers;
+  unsigned int col;
+  unsigned int row;
+};
+typedef struct _FepEventMouse FepEventMouse;
+
+/**
+ * FepClientFlags:
+ * @FEP_CLIENT_NONE: No flags
+ * @FEP_CLIENT_SHM: Exchange messages with the server through shared
+ *  memory instead of the control socket
+ * @FEP_CLIENT_OBSERVER: Only observe key events; the event filter
+ *  is called for every key after the other clients have processed
+ *  it, and its return value is ignored
+ * @FEP_CLIENT_NONBLOCK: Never block when sending requests; pending
+ *  requests are kept in a buffer written by fep_client_flush()
+ * @FEP_CLIENT_THREAD: Exchange messages with the server in a
+ *  background thread, so that the client can be used from several
+ *  threads; the event filter is called on that thread, or through
+ *  the function set with fep_client_set_executor()
+ */
+typedef enum _FepClientFlags
+  {
+    FEP_CLIENT_NONE = 0,
+    FEP_CLIENT_SHM = 1 << 0,
+    FEP_CLIENT_OBSERVER = 1 << 1,
+    FEP_CLIENT_NONBLOCK = 1 << 2,
+    FEP_CLIENT_THREAD = 1 << 3
+  } FepClientFlags;
+
+/**
+ * FepKeySubscriptionFlags:
+ * @FEP_KEY_SUBSCRIBE_NONE: Only receive keys matching the patterns
+ * @FEP_KEY_SUBSCRIBE_ALL: Receive all keys
+ * @FEP_KEY_SUBSCRIBE_COMPOSING: Receive all keys while the cursor
+ *  text set by the client is not empty
+ * @FEP_KEY_SUBSCRIBE_MOUSE: Receive mouse events, which are otherwise
+ *  not delivered
+ */
+typedef enum _FepKeySubscriptionFlags
+  {
+    FEP_KEY_SUBSCRIBE_NONE = 0,
+    FEP_KEY_SUBSCRIBE_ALL = 1 << 0,
+    FEP_KEY_SUBSCRIBE_COMPOSING = 1 << 1,
+    FEP_KEY_SUBSCRIBE_MOUSE = 1 << 2
+  } FepKeySubscriptionFlags;
+
+/**
+ * FepKeyPattern:
+ * @keyval: keysym value
+ * @modifiers: modifiers which must be set
+ * @modifiers_mask: modifiers taken into account when matching
+ *  @modifiers
+ *
+ * A key matches the pattern if its keysym is @keyval and its modifiers
+ * masked with @modifiers_mask equal @modifiers.
+ */
+struct _FepKeyPattern
+{
+  unsigned int keyval;
+  FepModifierType modifiers;
+  FepModifierType modifiers_mask;
+};
+typedef struct _FepKeyPattern FepKeyPattern;
+
+/**
+ * FEP_CLIENT_STATS_N_BUCKETS:
+ *
+ * Number of buckets in the histograms of #FepClientStats.
+ */
+#define FEP_CLIENT_STATS_N_BUCKETS 24
+
+/**
+ * FepClientStats:
+ * @n_key_events: number of key events received
+ * @n_key_events_handled: number of key events the event filter handled
+ * @filter_time: histogram of the time spent in the event filter
+ * @response_time: histogram of the time from reading a key event to
+ *  writing the response
+ * @latency: histogram of the time from the server sending a key event
+ *  to writing the response, which includes the time the server spent
+ *  on the other clients
+ *
+ * Statistics of the key events processed by a #FepClient.  The
+ * histograms count durations on a log scale: bucket 0 counts
+ * durations below 2 microseconds, bucket i counts those from 2^i to
+ * 2^(i+1) microseconds, and the last bucket counts all longer ones.
+ */
+struct _FepClientStats
+{
+  unsigned long n_key_events;
+  unsigned long n_key_events_handled;
+  unsigned long filter_time[FEP_CLIENT_STATS_N_BUCKETS];
+  unsigned long response_time[FEP_CLIENT_STATS_N_BUCKETS];
+  unsigned long latency[FEP_CLIENT_STATS_N_BUCKETS];
+};
+typedef struct _FepClientStats FepClientStats;
+
 typedef struct _FepClient FepClient;
 typedef int (*FepEventFilter) (FepEvent *event, void *data);
+typedef void (*FepTaskFunc) (void *data);
+typedef void (*FepExecutor) (FepTaskFunc func, void *func_data, void *data);
 
 FepClient *fep_client_open              (const char     *address);
+FepClient *fep_client_open_full         (const char     *address,
+                                         FepClientFlags  flags);
 int        fep_client_get_poll_fd       (FepClient      *client);
+int        fep_client_get_poll_events   (FepClient      *client);
+int        fep_client_flush             (FepClient      *client);
 void       fep_client_set_cursor_text   (FepClient      *client,
                                          const char     *text,
                                          FepAttribute   *attr);
+void       fep_client_update_cursor_text
+                                        (FepClient      *client,
+                                         size_t          start,
+                                         size_t          end,
+                                         const char     *text,
+                                         FepAttribute   *attr);
 void       fep_client_set_status_text   (FepClient      *client,
                                          const char     *text,
                                          FepAttribute   *attr);
@@ -93,10 +238,25 @@ void       fep_client_send_data         (FepClient      *client,
 void       fep_client_forward_key_event (FepClient      *client,
                                          unsigned int    keyval,
                                          FepModifierType modifiers);
+void       fep_client_set_priority      (FepClient      *client,
+                                         int             priority);
+void       fep_client_subscribe_keys    (FepClient      *client,
+                                         FepKeySubscriptionFlags flags,
+                                         const FepKeyPattern *patterns,
+                                         size_t          n_patterns);
+void       fep_client_begin             (FepClient      *client);
+void       fep_client_commit            (FepClient      *client);
 void       fep_client_set_event_filter  (FepClient      *client,
                                          FepEventFilter  filter,
                                          void           *data);
+void       fep_client_set_executor      (FepClient      *client,
+                                         FepExecutor     executor,
+                                         void           *data);
 int        fep_client_dispatch          (FepClient      *client);
+int        fep_client_dispatch_pending  (FepClient      *client);
+void       fep_client_get_stats         (FepClient      *client,
+                                         FepClientStats *r_stats);
+void       fep_client_reset_stats       (FepClient      *client);
 void       fep_client_close             (FepClient      *client);
 
 #endif	/* __LIBFEP_CLIENT_H__ */
@@ -24,42 +24,283 @@
 #include <stdint.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
 
-static const struct
-{
-  FepControlCommand command;
-  char *name;
-  size_t n_args;
-} commands[] =
+typedef enum
+  {
+    FEP_CONTROL_ARG_NONE,
+    FEP_CONTROL_ARG_UINT8,
+    FEP_CONTROL_ARG_UINT32,
+    FEP_CONTROL_ARG_ATTRIBUTE,
+    FEP_CONTROL_ARG_DATA
+  } FepControlArgType;
+
+/* Length of an argument of each type in the uncompressed encoding;
+   -1 means arbitrary length.  */
+static const ssize_t arg_lengths[] =
   {
-    { FEP_CONTROL_SET_CURSOR_TEXT, "SET_CURSOR_TEXT", 2 },
-    { FEP_CONTROL_SET_STATUS_TEXT, "SET_STATUS_TEXT", 2 },
-    { FEP_CONTROL_SEND_TEXT, "SEND_TEXT", 1 },
-    { FEP_CONTROL_SEND_DATA, "SEND_DATA", 1 },
-    { FEP_CONTROL_FORWARD_KEY_EVENT, "FORWARD_KEY_EVENT", 2 },
-    { FEP_CONTROL_KEY_EVENT, "KEY_EVENT", 3 },
-    { FEP_CONTROL_RESIZE_EVENT, "RESIZE_EVENT", 2 },
-    { FEP_CONTROL_RESPONSE, "RESPONSE", 2 }
+    [FEP_CONTROL_ARG_NONE] = 0,
+    [FEP_CONTROL_ARG_UINT8] = sizeof(uint8_t),
+    [FEP_CONTROL_ARG_UINT32] = sizeof(uint32_t),
+    [FEP_CONTROL_ARG_ATTRIBUTE] = 4 * sizeof(uint32_t),
+    [FEP_CONTROL_ARG_DATA] = -1
   };
 
+#define FEP_CONTROL_MAX_ARGS 4
+
+/* Set in the command byte of a message in the compact encoding.  The
+   command byte is followed by the payload length and the arguments,
+   whose encodings depend on their types: UINT8 is a single byte,
+   UINT32 is a varint, ATTRIBUTE is four varints, and DATA is a varint
+   length followed by the bytes.  Only frequently sent commands use
+   it; the others keep the uint32 length prefix for every argument.  */
+#define FEP_CONTROL_COMPACT 0x80
+
+/* Longest varint encoding of a uint32_t */
+#define FEP_VARINT_MAX 5
+
+/* Upper bound of the lengths read from the peer, either of a compact
+   payload or of a single argument; the same as the shared memory
+   ring, which can't carry a longer frame anyway */
+#define FEP_CONTROL_MAX_FRAME 65536
+
+static void
+append_varint (FepString *buf, uint32_t val)
+{
+  while (val >= 0x80)
+    {
+      _fep_string_append_c (buf, (val & 0x7F) | 0x80);
+      val >>= 7;
+    }
+  _fep_string_append_c (buf, val);
+}
+
 static int
-_fep_control_command_get_n_args (FepControlCommand command)
+parse_varint (const char **p, const char *end, uint32_t *r_val)
 {
+  uint32_t val = 0;
   int i;
-  for (i = 0; i < SIZEOF (commands); i++)
-    if (commands[i].command == command)
-      return commands[i].n_args;
+
+  for (i = 0; i < FEP_VARINT_MAX && *p < end; i++)
+    {
+      unsigned char c = *(*p)++;
+      val |= (uint32_t) (c & 0x7F) << (7 * i);
+      if ((c & 0x80) == 0)
+	{
+	  *r_val = val;
+	  return 0;
+	}
+    }
   return -1;
 }
 
-static const char *
-_fep_control_command_get_name (FepControlCommand command)
+static uint32_t
+arg_to_uint32 (const char *str)
+{
+  uint32_t intval;
+
+  memcpy (&intval, str, sizeof(uint32_t));
+#ifdef WORDS_BIGENDIAN
+  intval = bswap_32 (intval);
+#endif
+  return intval;
+}
+
+/* Compact encoders and decoders of each argument type.  The encoders
+   return false if the argument does not have the expected length, so
+   that the caller can fall back to the uncompressed encoding.  */
+
+static inline bool
+encode_arg_NONE (FepControlMessage *message, off_t index, FepString *buf)
+{
+  return true;
+}
+
+static inline bool
+encode_arg_UINT8 (FepControlMessage *message, off_t index, FepString *buf)
+{
+  FepString *arg = &message->args[index];
+
+  if (arg->len != sizeof(uint8_t))
+    return false;
+  _fep_string_append_c (buf, *arg->str);
+  return true;
+}
+
+static inline bool
+encode_arg_UINT32 (FepControlMessage *message, off_t index, FepString *buf)
+{
+  FepString *arg = &message->args[index];
+
+  if (arg->len != sizeof(uint32_t))
+    return false;
+  append_varint (buf, arg_to_uint32 (arg->str));
+  return true;
+}
+
+static inline bool
+encode_arg_ATTRIBUTE (FepControlMessage *message, off_t index,
+		      FepString *buf)
+{
+  FepString *arg = &message->args[index];
+  int i;
+
+  if (arg->len != 4 * sizeof(uint32_t))
+    return false;
+  for (i = 0; i < 4; i++)
+    append_varint (buf, arg_to_uint32 (arg->str + i * sizeof(uint32_t)));
+  return true;
+}
+
+static inline bool
+encode_arg_DATA (FepControlMessage *message, off_t index, FepString *buf)
+{
+  FepString *arg = &message->args[index];
+
+  append_varint (buf, arg->len);
+  _fep_string_append (buf, arg->str, arg->len);
+  return true;
+}
+
+static inline bool
+decode_arg_NONE (FepControlMessage *message, off_t index,
+		 const char **p, const char *end)
+{
+  return true;
+}
+
+static inline bool
+decode_arg_UINT8 (FepControlMessage *message, off_t index,
+		  const char **p, const char *end)
+{
+  if (*p == end)
+    return false;
+  _fep_control_message_write_uint8_arg (message, index, *(*p)++);
+  return true;
+}
+
+static inline bool
+decode_arg_UINT32 (FepControlMessage *message, off_t index,
+		   const char **p, const char *end)
 {
+  uint32_t val;
+
+  if (parse_varint (p, end, &val) < 0)
+    return false;
+  _fep_control_message_write_uint32_arg (message, index, val);
+  return true;
+}
+
+static inline bool
+decode_arg_ATTRIBUTE (FepControlMessage *message, off_t index,
+		      const char **p, const char *end)
+{
+  FepAttribute attr;
+  uint32_t vals[4];
   int i;
-  for (i = 0; i < SIZEOF (commands); i++)
-    if (commands[i].command == command)
-      return commands[i].name;
-  return NULL;
+
+  for (i = 0; i < 4; i++)
+    if (parse_varint (p, end, &vals[i]) < 0)
+      return false;
+  attr.type = vals[0];
+  attr.value = vals[1];
+  attr.start_index = vals[2];
+  attr.end_index = vals[3];
+  _fep_control_message_write_attribute_arg (message, index, &attr);
+  return true;
+}
+
+static inline bool
+decode_arg_DATA (FepControlMessage *message, off_t index,
+		 const char **p, const char *end)
+{
+  uint32_t val;
+
+  if (parse_varint (p, end, &val) < 0 || end - *p < val)
+    return false;
+  _fep_control_message_write_string_arg (message, index, *p, val);
+  *p += val;
+  return true;
+}
+
+/* Generate encode_<name> and decode_<name> for each command, which
+   handle the arguments of the compact encoding in sequence.  */
+#define FEP_CONTROL_COMMAND(NAME, name, value, direction,		\
+			    arg0, arg1, arg2, arg3, compact, coalesce)	\
+  static bool								\
+  encode_##name (FepControlMessage *message, FepString *buf)		\
+  {									\
+    return encode_arg_##arg0 (message, 0, buf)				\
+      && encode_arg_##arg1 (message, 1, buf)				\
+      && encode_arg_##arg2 (message, 2, buf)				\
+      && encode_arg_##arg3 (message, 3, buf);				\
+  }									\
+  static bool								\
+  decode_##name (FepControlMessage *message,				\
+		 const char **p, const char *end)			\
+  {									\
+    return decode_arg_##arg0 (message, 0, p, end)			\
+      && decode_arg_##arg1 (message, 1, p, end)				\
+      && decode_arg_##arg2 (message, 2, p, end)				\
+      && decode_arg_##arg3 (message, 3, p, end);			\
+  }
+#include <libfep/control.def>
+#undef FEP_CONTROL_COMMAND
+
+struct _FepControlCommandEntry
+{
+  const char *name;
+  size_t n_args;
+  FepControlArgType arg_types[FEP_CONTROL_MAX_ARGS];
+  bool compact;
+  bool coalesce;
+  bool (*encode) (FepControlMessage *message, FepString *buf);
+  bool (*decode) (FepControlMessage *message,
+		  const char **p, const char *end);
+};
+typedef struct _FepControlCommandEntry FepControlCommandEntry;
+
+/* Indexed by command; unused values have NULL name.  */
+static const FepControlCommandEntry commands[FEP_CONTROL_COMMAND_LAST] =
+  {
+#define FEP_CONTROL_COMMAND(NAME, name, value, direction,		\
+			    arg0, arg1, arg2, arg3, compact, coalesce)	\
+    [FEP_CONTROL_##NAME] =						\
+      {									\
+	#NAME,								\
+	(FEP_CONTROL_ARG_##arg0 != FEP_CONTROL_ARG_NONE)		\
+	+ (FEP_CONTROL_ARG_##arg1 != FEP_CONTROL_ARG_NONE)		\
+	+ (FEP_CONTROL_ARG_##arg2 != FEP_CONTROL_ARG_NONE)		\
+	+ (FEP_CONTROL_ARG_##arg3 != FEP_CONTROL_ARG_NONE),		\
+	{ FEP_CONTROL_ARG_##arg0,					\
+	  FEP_CONTROL_ARG_##arg1,					\
+	  FEP_CONTROL_ARG_##arg2,					\
+	  FEP_CONTROL_ARG_##arg3 },					\
+	compact,							\
+	coalesce,							\
+	encode_##name,							\
+	decode_##name							\
+      },
+#include <libfep/control.def>
+#undef FEP_CONTROL_COMMAND
+  };
+
+static const FepControlCommandEntry *
+_fep_control_command_lookup (unsigned int command)
+{
+  if (command >= FEP_CONTROL_COMMAND_LAST || commands[command].name == NULL)
+    return NULL;
+  return &commands[command];
+}
+
+static bool
+arg_length_is_valid (const FepControlCommandEntry *entry,
+		     off_t                         index,
+		     size_t                        length)
+{
+  ssize_t expected = arg_lengths[entry->arg_types[index]];
+  return expected < 0 ? length <= FEP_CONTROL_MAX_FRAME : expected == length;
 }
 
 static char *
@@ -70,7 +311,7 @@ _fep_control_message_to_string (FepControlMessage *message)
   int i;
   char *buf, *p;
 
-  command_name = _fep_control_command_get_name (message->command);
+  command_name = _fep_control_command_lookup (message->command)->name;
   command_length = strlen (command_name);
   total = command_length + 1;
   for (i = 0; i < message->n_args; i++)
@@ -101,112 +342,231 @@ _fep_control_message_to_string (FepControlMessage *message)
   return buf;
 }
 
-int
-_fep_read_control_message (int fd,
-			   FepControlMessage *message)
+void
+_fep_log_control_message (const char        *action,
+			  FepControlMessage *message)
 {
-  char buf[BUFSIZ];
-  FepString *args;
-  int retval, i;
+  if (fep_get_log_level () >= FEP_LOG_LEVEL_DEBUG)
+    {
+      char *str = _fep_control_message_to_string (message);
+      fep_log (FEP_LOG_LEVEL_DEBUG, "%s %s", action, str);
+      free (str);
+    }
+}
 
-  memset (buf, 0, BUFSIZ);
-  retval = read (fd, buf, 1);
-  if (retval < 0)
+/* Decode a compact payload into MESSAGE, whose arguments have the same
+   representation as those of the uncompressed encoding.  */
+static int
+decode_compact_args (FepControlMessage            *message,
+		     const FepControlCommandEntry *entry,
+		     const char                   *data,
+		     size_t                        length)
+{
+  const char *p = data, *end = data + length;
+
+  _fep_control_message_alloc_args (message, entry->n_args);
+  if (!entry->decode (message, &p, end) || p != end)
     {
-      fep_log (FEP_LOG_LEVEL_WARNING,
-	       "failed to read from %d: %s",
-	       fd, strerror (errno));
+      _fep_control_message_free_args (message);
       return -1;
     }
-  if (retval == 0)
+  return 0;
+}
+
+static int
+read_full (int fd, char *buf, size_t count)
+{
+  size_t total;
+  ssize_t retval;
+
+  for (total = 0; total < count; total += retval)
     {
-      fep_log (FEP_LOG_LEVEL_DEBUG,
-	       "connection %d closed",
-	       fd);
-      return -1;
+      retval = read (fd, buf + total, count - total);
+      if (retval < 0 && errno == EINTR)
+	retval = 0;
+      else if (retval < 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_WARNING,
+		   "failed to read from %d: %s",
+		   fd, strerror (errno));
+	  return -1;
+	}
+      else if (retval == 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_DEBUG,
+		   "connection %d closed",
+		   fd);
+	  return -1;
+	}
     }
+  return 0;
+}
+
+/* Read a varint from FD.  The bytes available are peeked at first,
+   so that the varint is usually consumed with a single read instead
+   of one read per byte, without eating into the following payload.  */
+static int
+read_varint (int fd, uint32_t *r_val)
+{
+  char buf[FEP_VARINT_MAX];
+  const char *p;
+  size_t count = 0, end;
+  ssize_t retval;
 
-  retval = _fep_control_command_get_n_args (buf[0]);
-  if (retval < -1)
+  while (count < FEP_VARINT_MAX)
+    {
+      retval = recv (fd, buf + count, FEP_VARINT_MAX - count, MSG_PEEK);
+      if (retval < 0 && errno == EINTR)
+	continue;
+      else if (retval < 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_WARNING,
+		   "failed to read from %d: %s",
+		   fd, strerror (errno));
+	  return -1;
+	}
+      else if (retval == 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_DEBUG,
+		   "connection %d closed",
+		   fd);
+	  return -1;
+	}
+
+      for (end = count; end < count + retval; end++)
+	if ((buf[end] & 0x80) == 0)
+	  {
+	    if (read_full (fd, buf + count, end + 1 - count) < 0)
+	      return -1;
+	    p = buf;
+	    return parse_varint (&p, buf + end + 1, r_val);
+	  }
+
+      /* the rest of the varint has not arrived yet */
+      if (read_full (fd, buf + count, retval) < 0)
+	return -1;
+      count += retval;
+    }
+
+  fep_log (FEP_LOG_LEVEL_WARNING, "invalid varint from %d", fd);
+  return -1;
+}
+
+int
+_fep_read_control_message (int fd,
+			   FepControlMessage *message)
+{
+  const FepControlCommandEntry *entry;
+  unsigned char c;
+  int i;
+
+  if (read_full (fd, (char *) &c, 1) < 0)
+    return -1;
+
+  entry = _fep_control_command_lookup (c & ~FEP_CONTROL_COMPACT);
+  if (entry == NULL)
     {
       fep_log (FEP_LOG_LEVEL_WARNING,
 	       "read unknown command %d",
-	       buf[0]);
+	       c);
       return -1;
     }
 
-  message->command = buf[0];
-  message->n_args = retval;
-  message->args = xcalloc (message->n_args, sizeof(FepString));
-  for (i = 0, args = message->args; i < message->n_args; i++, args++)
+  message->command = c & ~FEP_CONTROL_COMPACT;
+  if (c & FEP_CONTROL_COMPACT)
     {
-      FepString arg;
+      char *payload;
       uint32_t len;
+      int retval;
 
-      retval = read (fd, buf, 4);
-      if (retval < 4)
+      /* the payload length is a varint too */
+      if (read_varint (fd, &len) < 0)
+	return -1;
+      if (len > FEP_CONTROL_MAX_FRAME)
 	{
-	  _fep_control_message_free_args (message);
 	  fep_log (FEP_LOG_LEVEL_WARNING,
-		   "failed to read argument length from %d: %s",
-		   fd, errno != 0 ? strerror (errno) : "too short");
+		   "invalid payload length from %d: %u", fd, len);
 	  return -1;
 	}
-      len = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
-#ifdef WORDS_BIGENDIAN
-      len = bswap_32 (len);
-#endif
-      memset (&arg, 0, sizeof(FepString));
-      while (len > 0)
+
+      payload = xcharalloc (len);
+      if (read_full (fd, payload, len) < 0)
+	{
+	  free (payload);
+	  return -1;
+	}
+      retval = decode_compact_args (message, entry, payload, len);
+      free (payload);
+      if (retval < 0)
 	{
-	  retval = read (fd, buf, len);
-	  if (retval < 0)
+	  fep_log (FEP_LOG_LEVEL_WARNING,
+		   "malformed %s from %d", entry->name, fd);
+	  return -1;
+	}
+    }
+  else
+    {
+      _fep_control_message_alloc_args (message, entry->n_args);
+      for (i = 0; i < message->n_args; i++)
+	{
+	  uint32_t len;
+
+	  if (read_full (fd, (char *) &len, 4) < 0)
 	    {
 	      _fep_control_message_free_args (message);
+	      return -1;
+	    }
+#ifdef WORDS_BIGENDIAN
+	  len = bswap_32 (len);
+#endif
+	  if (!arg_length_is_valid (entry, i, len))
+	    {
 	      fep_log (FEP_LOG_LEVEL_WARNING,
-		       "failed to read from %d: %s",
-		       fd, strerror (errno));
+		       "malformed %s from %d", entry->name, fd);
+	      _fep_control_message_free_args (message);
+	      return -1;
+	    }
+	  message->args[i].str = xcharalloc (len);
+	  message->args[i].cap = message->args[i].len = len;
+	  if (read_full (fd, message->args[i].str, len) < 0)
+	    {
+	      _fep_control_message_free_args (message);
 	      return -1;
 	    }
-	  _fep_string_append (&arg, buf, retval);
-	  len -= retval;
 	}
-      args->str = xcharalloc (arg.len);
-      memcpy (args->str, arg.str, arg.len);
-      args->cap = args->len = arg.len;
-      _fep_string_clear (&arg);
-      free (arg.str);
-      arg.str = NULL;
     }
 
-  if (fep_get_log_level () >= FEP_LOG_LEVEL_DEBUG)
-    {
-      char *str = _fep_control_message_to_string (message);
-      fep_log (FEP_LOG_LEVEL_DEBUG, "read %s", str);
-      free (str);
-    }
+  _fep_log_control_message ("read", message);
   return 0;
 }
 
-int
-_fep_write_control_message (int fd,
-			    FepControlMessage *message)
+void
+_fep_control_message_encode (FepControlMessage *message,
+			     FepString         *buf)
 {
-  char command_char = message->command;
-  int retval, i;
+  const FepControlCommandEntry *entry;
+  int i;
 
-  retval = write (fd, &command_char, 1);
-  if (retval < 1)
+  entry = _fep_control_command_lookup (message->command);
+  if (entry && entry->compact && entry->n_args == message->n_args)
     {
-      fep_log (FEP_LOG_LEVEL_WARNING,
-	       "failed to write to %d: %s",
-	       fd, retval < 0 ? strerror (errno) : "can't write command byte");
-      return -1;
+      FepString payload;
+
+      memset (&payload, 0, sizeof(FepString));
+      if (entry->encode (message, &payload))
+	{
+	  _fep_string_append_c (buf, message->command | FEP_CONTROL_COMPACT);
+	  append_varint (buf, payload.len);
+	  _fep_string_append (buf, payload.str, payload.len);
+	  free (payload.str);
+	  return;
+	}
+      free (payload.str);
     }
 
+  _fep_string_append_c (buf, message->command);
   for (i = 0; i < message->n_args; i++)
     {
-      size_t total;
       uint32_t length_word;
 
 #ifdef WORDS_BIGENDIAN
@@ -214,40 +574,221 @@ _fep_write_control_message (int fd,
 #else
       length_word = message->args[i].len;
 #endif
+      _fep_string_append (buf, (char *) &length_word, 4);
+      _fep_string_append (buf, message->args[i].str, message->args[i].len);
+    }
+}
+
+int
+_fep_control_message_decode (FepControlMessage *message,
+			     const char        *data,
+			     size_t             length)
+{
+  const FepControlCommandEntry *entry;
+  const char *p = data, *end = data + length;
+  unsigned char c;
+  int i;
+
+  if (length < 1)
+    return -1;
+
+  c = *p++;
+  entry = _fep_control_command_lookup (c & ~FEP_CONTROL_COMPACT);
+  if (entry == NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "decoded unknown command %d",
+	       c);
+      return -1;
+    }
+
+  message->command = c & ~FEP_CONTROL_COMPACT;
+  if (c & FEP_CONTROL_COMPACT)
+    {
+      uint32_t len;
+
+      if (parse_varint (&p, end, &len) < 0
+	  || end - p != len
+	  || decode_compact_args (message, entry, p, len) < 0)
+	goto fail_free;
+      _fep_log_control_message ("decode", message);
+      return 0;
+    }
+
+  _fep_control_message_alloc_args (message, entry->n_args);
+  for (i = 0; i < entry->n_args; i++)
+    {
+      uint32_t len;
+
+      if (end - p < 4)
+	goto fail;
+      memcpy (&len, p, 4);
+#ifdef WORDS_BIGENDIAN
+      len = bswap_32 (len);
+#endif
+      p += 4;
+      if (end - p < len || !arg_length_is_valid (entry, i, len))
+	goto fail;
+      message->args[i].str = xmemdup (p, len);
+      message->args[i].cap = message->args[i].len = len;
+      p += len;
+    }
+  if (p != end)
+    goto fail;
+
+  _fep_log_control_message ("decode", message);
+  return 0;
+
+ fail:
+  _fep_control_message_free_args (message);
+ fail_free:
+  fep_log (FEP_LOG_LEVEL_WARNING,
+	   "malformed control message frame of length %zu",
+	   length);
+  return -1;
+}
+
+/* Return the length of the control message at the beginning of DATA,
+   0 if DATA does not hold a complete message yet, or -1 if it is
+   malformed.  */
+ssize_t
+_fep_control_message_frame_length (const char *data,
+				   size_t      length)
+{
+  const FepControlCommandEntry *entry;
+  const char *p = data, *end = data + length;
+  unsigned char c;
+  int i;
+
+  if (length < 1)
+    return 0;
+
+  c = *p++;
+  entry = _fep_control_command_lookup (c & ~FEP_CONTROL_COMPACT);
+  if (entry == NULL)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "unknown command %d",
+	       c);
+      return -1;
+    }
+
+  if (c & FEP_CONTROL_COMPACT)
+    {
+      uint32_t len;
+
+      /* the payload length may be truncated, or too long */
+      if (parse_varint (&p, end, &len) < 0)
+	return p == end && p - data - 1 < FEP_VARINT_MAX ? 0 : -1;
+      return end - p < len ? 0 : (p - data) + len;
+    }
+
+  for (i = 0; i < entry->n_args; i++)
+    {
+      uint32_t len;
+
+      if (end - p < 4)
+	return 0;
+      memcpy (&len, p, 4);
+#ifdef WORDS_BIGENDIAN
+      len = bswap_32 (len);
+#endif
+      p += 4;
+      if (!arg_length_is_valid (entry, i, len))
+	return -1;
+      if (end - p < len)
+	return 0;
+      p += len;
+    }
+  return p - data;
+}
 
-      retval = write (fd, &length_word, 4);
+int
+_fep_write_control_message (int fd,
+			    FepControlMessage *message)
+{
+  FepString buf;
+  size_t total;
+  ssize_t retval;
+
+  /* Encode the whole message first, so it normally goes out with a
+     single write.  */
+  memset (&buf, 0, sizeof(FepString));
+  _fep_control_message_encode (message, &buf);
+
+  for (total = 0; total < buf.len; total += retval)
+    {
+      retval = write (fd, buf.str + total, buf.len - total);
       if (retval < 0)
 	{
+	  if (errno == EINTR)
+	    {
+	      retval = 0;
+	      continue;
+	    }
 	  fep_log (FEP_LOG_LEVEL_WARNING,
 		   "failed to write to %d: %s",
 		   fd, strerror (errno));
+	  free (buf.str);
 	  return -1;
 	}
-
-      for (total = 0; total < message->args[i].len; total += retval)
-	{
-	  retval = write (fd,
-			  message->args[i].str + total,
-			  message->args[i].len - total);
-	  if (retval < 0)
-	    {
-	      fep_log (FEP_LOG_LEVEL_WARNING,
-		       "failed write to %d: %s",
-		       fd, strerror (errno));
-	      return -1;
-	    }
-	}
     }
+  free (buf.str);
 
-  if (fep_get_log_level () >= FEP_LOG_LEVEL_DEBUG)
+  _fep_log_control_message ("write", message);
+  return 0;
+}
+
+/* Write MESSAGE to FD without blocking.  Returns 0 on success, 1 if
+   nothing could be written, and -1 on error or if only a part of
+   MESSAGE has been written, in which case the stream is broken.  */
+int
+_fep_write_control_message_nonblock (int                fd,
+				     FepControlMessage *message)
+{
+  FepString buf;
+  ssize_t retval;
+
+  memset (&buf, 0, sizeof(FepString));
+  _fep_control_message_encode (message, &buf);
+
+  do
+    retval = send (fd, buf.str, buf.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  while (retval < 0 && errno == EINTR);
+  free (buf.str);
+
+  if (retval < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 1;
+  if (retval < 0)
     {
-      char *str = _fep_control_message_to_string (message);
-      fep_log (FEP_LOG_LEVEL_DEBUG, "write %s", str);
-      free (str);
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "failed to write to %d: %s",
+	       fd, strerror (errno));
+      return -1;
     }
+  if (retval < buf.len)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "partial write to %d",
+	       fd);
+      return -1;
+    }
+
+  _fep_log_control_message ("write", message);
   return 0;
 }
 
+void
+_fep_control_message_init (FepControlMessage *message,
+			   FepControlCommand  command)
+{
+  const FepControlCommandEntry *entry = _fep_control_command_lookup (command);
+
+  assert (entry != NULL);
+  message->command = command;
+  _fep_control_message_alloc_args (message, entry->n_args);
+}
+
 void
 _fep_control_message_alloc_args (FepControlMessage *message, size_t n_args)
 {
@@ -269,21 +810,13 @@ _fep_control_message_read_uint32_arg (FepControlMessage *message,
                                       off_t              index,
                                       uint32_t          *r_val)
 {
-  uint32_t intval;
-
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
   if (message->args[index].len != sizeof(uint32_t))
     return -1;
 
-  intval = *(uint32_t *) message->args[index].str;
-#ifdef WORDS_BIGENDIAN
-  *r_val = bswap_32 (intval);
-#else
-  *r_val = intval;
-#endif
-
+  *r_val = arg_to_uint32 (message->args[index].str);
   return 0;
 }
 
@@ -294,7 +827,7 @@ _fep_control_message_write_uint32_arg (FepControlMessage *message,
 {
   uint32_t intval;
 
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
 #ifdef WORDS_BIGENDIAN
@@ -313,7 +846,7 @@ _fep_control_message_write_uint8_arg (FepControlMessage *message,
 				      off_t index,
 				      uint8_t val)
 {
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
   message->args[index].str = xmemdup ((char *) &val, sizeof(uint8_t));
@@ -328,7 +861,7 @@ _fep_control_message_write_string_arg (FepControlMessage *message,
 				       const char *str,
 				       size_t length)
 {
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
   message->args[index].str = xmemdup (str, length);
@@ -343,44 +876,29 @@ _fep_control_message_read_attribute_arg (FepControlMessage *message,
 					 FepAttribute *r_attr)
 {
   char *p;
-  uint8_t intval;
 
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
   if (message->args[index].len != 4 * sizeof(uint32_t))
     return -1;
 
   p = message->args[index].str;
-  intval = *(uint32_t *) p;
-  p += sizeof(uint32_t);
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  r_attr->type = intval;
+  r_attr->type = arg_to_uint32 (p);
+  r_attr->value = arg_to_uint32 (p + sizeof(uint32_t));
+  r_attr->start_index = arg_to_uint32 (p + 2 * sizeof(uint32_t));
+  r_attr->end_index = arg_to_uint32 (p + 3 * sizeof(uint32_t));
 
-  intval = *(uint32_t *) p;
-  p += sizeof(uint32_t);
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  r_attr->value = intval;
+  return 0;
+}
 
-  intval = *(uint32_t *) p;
-  p += sizeof(uint32_t);
+static void
+uint32_to_arg (char *str, uint32_t val)
+{
 #ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
+  val = bswap_32 (val);
 #endif
-  r_attr->start_index = intval;
-
-  intval = *(uint32_t *) p;
-  p += sizeof(uint32_t);
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  r_attr->end_index = intval;
-
-  return 0;
+  memcpy (str, &val, sizeof(uint32_t));
 }
 
 int
@@ -388,42 +906,18 @@ _fep_control_message_write_attribute_arg (FepControlMessage *message,
 					 off_t index,
 					 const FepAttribute *attr)
 {
-  uint32_t intval;
   char *p;
 
-  if (index > message->n_args)
+  if (index < 0 || index >= message->n_args)
     return -1;
 
   p = message->args[index].str = xcalloc (4, sizeof(uint32_t));
   message->args[index].cap = message->args[index].len = 4 * sizeof(uint32_t);
 
-  intval = attr->type;
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  memcpy (p, (char *) &intval, sizeof(uint32_t));
-  p += sizeof(uint32_t);
-
-  intval = attr->value;
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  memcpy (p, (char *) &intval, sizeof(uint32_t));
-  p += sizeof(uint32_t);
-
-  intval = attr->start_index;
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  memcpy (p, (char *) &intval, sizeof(uint32_t));
-  p += sizeof(uint32_t);
-
-  intval = attr->end_index;
-#ifdef WORDS_BIGENDIAN
-  intval = bswap_32 (intval);
-#endif
-  memcpy (p, (char *) &intval, sizeof(uint32_t));
-  p += sizeof(uint32_t);
+  uint32_to_arg (p, attr->type);
+  uint32_to_arg (p + sizeof(uint32_t), attr->value);
+  uint32_to_arg (p + 2 * sizeof(uint32_t), attr->start_index);
+  uint32_to_arg (p + 3 * sizeof(uint32_t), attr->end_index);
 
   return 0;
 }
@@ -446,19 +940,70 @@ _fep_control_message_free (FepControlMessage *message)
   free (message);
 }
 
+/* Current time in microseconds of CLOCK_MONOTONIC, modulo 2^32, used
+   to timestamp key events.  Differences are meaningful for about an
+   hour.  */
+uint32_t
+_fep_get_monotonic_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool
+_fep_control_command_coalesces (FepControlCommand command)
+{
+  const FepControlCommandEntry *entry = _fep_control_command_lookup (command);
+  return entry && entry->coalesce;
+}
+
 FepList *
 _fep_append_control_message (FepList *head,
 			     FepControlMessage *message)
 {
-  FepControlMessage *_message = xzalloc (sizeof(FepControlMessage));
-  _fep_control_message_copy (_message, message);
-
-  if (fep_get_log_level () >= FEP_LOG_LEVEL_DEBUG)
+  const FepControlCommandEntry *entry;
+  FepControlMessage *_message;
+
+  /* drop the queued message superseded by MESSAGE, if any; only the
+     newest one of the same command can be, since the older ones have
+     been kept for a reason */
+  entry = _fep_control_command_lookup (message->command);
+  if (entry && entry->coalesce)
     {
-      char *str = _fep_control_message_to_string (_message);
-      fep_log (FEP_LOG_LEVEL_DEBUG, "queue %s", str);
-      free (str);
+      FepList *link, *last = NULL;
+      bool keep = false;
+
+      for (link = head; link; link = link->next)
+	{
+	  _message = link->data;
+	  if (_message->command == message->command)
+	    {
+	      last = link;
+	      keep = false;
+	    }
+	  /* a queued delta needs the cursor text it applies to */
+	  else if (last
+		   && message->command == FEP_CONTROL_SET_CURSOR_TEXT
+		   && _message->command == FEP_CONTROL_SET_CURSOR_TEXT_DELTA)
+	    keep = true;
+	}
+
+      if (last && !keep)
+	{
+	  _message = last->data;
+	  _fep_log_control_message ("coalesce", _message);
+	  head = _fep_list_remove_link (head, last);
+	  _fep_control_message_free (_message);
+	  free (last);
+	}
     }
 
+  _message = xzalloc (sizeof(FepControlMessage));
+  _fep_control_message_copy (_message, message);
+
+  _fep_log_control_message ("queue", _message);
+
   return _fep_list_append (head, _message);
 }
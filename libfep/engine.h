@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2012 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBFEP_ENGINE_H__
+#define __LIBFEP_ENGINE_H__
+
+/**
+ * SECTION:engine
+ * @short_description: Input method engine loaded into the FEP server
+ *
+ * An engine is a shared object which the FEP server loads with the
+ * `--engine` option.  It handles key events inside the server
+ * process, without the round trip a #FepClient needs.  The object
+ * must export a function named %FEP_ENGINE_ENTRY_POINT of type
+ * #FepEngineNewFunc.
+ */
+
+/**
+ * FEP_ENGINE_ABI_VERSION:
+ *
+ * Version of the #FepEngine structure layout, which an engine must
+ * store in its @abi_version field.
+ */
+#define FEP_ENGINE_ABI_VERSION 1
+
+/**
+ * FEP_ENGINE_ENTRY_POINT:
+ *
+ * Name of the function an engine must export.
+ */
+#define FEP_ENGINE_ENTRY_POINT "fep_engine_new"
+
+typedef struct _FepEngineHost FepEngineHost;
+typedef struct _FepEngine FepEngine;
+
+/**
+ * FepEngineHost:
+ * @send_text: Send text to the child process, like
+ *  fep_client_send_text()
+ * @send_data: Send data to the child process, like
+ *  fep_client_send_data()
+ * @forward_key_event: Send a key event to the child process, like
+ *  fep_client_forward_key_event()
+ * @data: private data of the server
+ *
+ * Functions provided by the FEP server to an engine.
+ */
+struct _FepEngineHost
+{
+  void (*send_text) (FepEngineHost  *host,
+                     const char     *text);
+  void (*send_data) (FepEngineHost  *host,
+                     const char     *data,
+                     size_t          length);
+  void (*forward_key_event) (FepEngineHost  *host,
+                             unsigned int    keyval,
+                             FepModifierType modifiers);
+  void *data;
+};
+
+/**
+ * FepEngine:
+ * @abi_version: must be %FEP_ENGINE_ABI_VERSION
+ * @filter_event: Called for each event, with the same semantics as
+ *  #FepEventFilter: return non-zero if the event is handled
+ * @get_cursor_text: (allow-none): Return the text to display at the
+ *  cursor position and fill in its attribute; called after each
+ *  @filter_event
+ * @get_status_text: (allow-none): Return the text to display at the
+ *  bottom; called after each @filter_event
+ * @free: Free the engine
+ * @data: private data of the engine
+ *
+ * Functions provided by an engine to the FEP server.
+ */
+struct _FepEngine
+{
+  unsigned int abi_version;
+  int (*filter_event) (FepEngine    *engine,
+                       FepEvent     *event);
+  const char *(*get_cursor_text) (FepEngine    *engine,
+                                  FepAttribute *r_attr);
+  const char *(*get_status_text) (FepEngine    *engine,
+                                  FepAttribute *r_attr);
+  void (*free) (FepEngine *engine);
+  void *data;
+};
+
+/**
+ * FepEngineNewFunc:
+ * @host: a #FepEngineHost, valid until the engine is freed
+ * @args: (allow-none): arguments given on the command line
+ *
+ * Type of the %FEP_ENGINE_ENTRY_POINT function.
+ *
+ * Returns: a new #FepEngine, or %NULL on failure.
+ */
+typedef FepEngine *(*FepEngineNewFunc) (FepEngineHost *host,
+                                        const char    *args);
+
+#endif	/* __LIBFEP_ENGINE_H__ */
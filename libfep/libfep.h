@@ -22,6 +22,7 @@
 #include <libfep/keydefs.h>
 #include <libfep/attribute.h>
 #include <libfep/client.h>
+#include <libfep/engine.h>
 #include <libfep/logger.h>
 
 #endif	/* __LIBFEP_H__ */
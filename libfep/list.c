@@ -42,3 +42,31 @@ _fep_list_append (FepList *head, void *data)
 
   return head;
 }
+
+/* Unlink LINK from the list starting at HEAD and return the new head.
+   LINK itself is not freed.  */
+FepList *
+_fep_list_remove_link (FepList *head, FepList *link)
+{
+  FepList *last = head->prev ? head->prev : head;
+
+  if (link == head)
+    {
+      head = link->next;
+      if (head)
+	head->prev = last == head ? NULL : last;
+    }
+  else if (link == last)
+    {
+      link->prev->next = NULL;
+      head->prev = link->prev == head ? NULL : link->prev;
+    }
+  else
+    {
+      link->prev->next = link->next;
+      link->next->prev = link->prev;
+    }
+
+  link->prev = link->next = NULL;
+  return head;
+}
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include "xalloc.h"
 #include "xvasprintf.h"
@@ -81,27 +82,24 @@ struct _FepList
 };
 typedef struct _FepList FepList;
 
-FepList *_fep_list_append (FepList *head, void *data);
+FepList *_fep_list_append      (FepList *head, void *data);
+FepList *_fep_list_remove_link (FepList *head, FepList *link);
 
 /* control.c */
 /* Note that each control message from server to client has return
    value, while the opposite does not.
 
-   See _fep_dispatch_control_message in fep/control.c for server and
+   The messages are defined in control.def.  See
+   _fep_dispatch_control_message in fep/control.c for server and
    fep_client_dispatch in libfep/client.c for client handling. */
 typedef enum
   {
-    /* client to server */
-    FEP_CONTROL_SET_CURSOR_TEXT = 1,
-    FEP_CONTROL_SET_STATUS_TEXT = 2,
-    FEP_CONTROL_SEND_TEXT = 3,
-    FEP_CONTROL_SEND_DATA = 4,
-    FEP_CONTROL_FORWARD_KEY_EVENT = 5,
-    /* server to client */
-    FEP_CONTROL_KEY_EVENT = 6,
-    FEP_CONTROL_RESIZE_EVENT = 7,
-    /* response from client */
-    FEP_CONTROL_RESPONSE = 8
+#define FEP_CONTROL_COMMAND(NAME, name, value, direction,	\
+			    arg0, arg1, arg2, arg3, compact, coalesce)	\
+    FEP_CONTROL_##NAME = value,
+#include <libfep/control.def>
+#undef FEP_CONTROL_COMMAND
+    FEP_CONTROL_COMMAND_LAST
   } FepControlCommand;
 
 struct _FepControlMessage
@@ -116,8 +114,23 @@ int      _fep_read_control_message               (int                 fd,
                                                   FepControlMessage  *message);
 int      _fep_write_control_message              (int                 fd,
                                                   FepControlMessage  *message);
+int      _fep_write_control_message_nonblock     (int                 fd,
+                                                  FepControlMessage  *message);
+void     _fep_control_message_encode             (FepControlMessage  *message,
+                                                  FepString          *buf);
+int      _fep_control_message_decode             (FepControlMessage  *message,
+                                                  const char         *data,
+                                                  size_t              length);
+ssize_t  _fep_control_message_frame_length       (const char         *data,
+                                                  size_t              length);
+void     _fep_log_control_message                (const char         *action,
+                                                  FepControlMessage  *message);
+uint32_t _fep_get_monotonic_time                 (void);
+bool     _fep_control_command_coalesces          (FepControlCommand   command);
 FepList *_fep_append_control_message             (FepList            *head,
                                                   FepControlMessage  *message);
+void     _fep_control_message_init               (FepControlMessage  *message,
+                                                  FepControlCommand   command);
 void     _fep_control_message_alloc_args         (FepControlMessage  *message,
                                                   size_t              n_args);
 void     _fep_control_message_free_args          (FepControlMessage  *message);
@@ -142,4 +155,40 @@ int      _fep_control_message_write_attribute_arg (FepControlMessage  *message,
                                                    off_t               index,
                                                    const FepAttribute *attr);
 
+/* shm.c */
+/* The shared memory transport consists of a memfd holding two
+   single-producer single-consumer rings of encoded control messages,
+   one per direction, and an eventfd per direction used for wakeups.
+   The descriptors are created by the server and passed to the client
+   over the control socket, which is then only used to detect
+   hangups. */
+#define FEP_SHM_N_FDS 3
+
+typedef struct _FepShm FepShm;
+
+int      _fep_shm_create                         (int                *r_fds);
+FepShm  *_fep_shm_new                            (int                *fds,
+                                                  bool                is_server,
+                                                  int                 control);
+void     _fep_shm_free                           (FepShm             *shm);
+int      _fep_shm_get_poll_fd                    (FepShm             *shm);
+void     _fep_shm_set_wakeup_fd                  (FepShm             *shm,
+                                                  int                 fd);
+int      _fep_shm_read_control_message           (FepShm             *shm,
+                                                  FepControlMessage  *message,
+                                                  bool                block);
+int      _fep_shm_write_control_message          (FepShm             *shm,
+                                                  FepControlMessage  *message,
+                                                  bool                block);
+int      _fep_shm_write_frame                    (FepShm             *shm,
+                                                  const char         *data,
+                                                  uint32_t            len,
+                                                  bool                block);
+int      _fep_send_fds                           (int                 fd,
+                                                  const int          *fds,
+                                                  size_t              n_fds);
+int      _fep_receive_fds                        (int                 fd,
+                                                  int                *fds,
+                                                  size_t              n_fds);
+
 #endif	/* __LIBFEP_PRIVATE_H__ */
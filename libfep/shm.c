@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2012 Daiki Ueno <ueno@unixuser.org>
+ * Copyright (C) 2012 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libfep/private.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H)
+#define FEP_SHM_SUPPORTED 1
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+/* Size of the data area of each ring; must be a power of two.  */
+#define FEP_SHM_RING_SIZE 65536
+#define FEP_SHM_CACHELINE 64
+
+/* Ring header placed in the shared memory.  Positions are free
+   running counters; head is only written by the consumer and tail
+   only by the producer, so they live in separate cache lines.  Each
+   frame in the data area is a 32-bit length followed by an encoded
+   control message, possibly wrapping around the end.  */
+struct _FepShmRing
+{
+  uint32_t head;
+  char pad1[FEP_SHM_CACHELINE - sizeof(uint32_t)];
+  uint32_t tail;
+  /* set by the consumer before it goes to sleep on the eventfd */
+  uint32_t waiting;
+  char pad2[FEP_SHM_CACHELINE - 2 * sizeof(uint32_t)];
+  char data[FEP_SHM_RING_SIZE];
+};
+typedef struct _FepShmRing FepShmRing;
+
+struct _FepShm
+{
+  void *map;
+  size_t map_size;
+  FepShmRing *in;
+  FepShmRing *out;
+  /* eventfd signalled when IN has data */
+  int in_fd;
+  /* eventfd to signal when OUT has data */
+  int out_fd;
+  /* control socket, used to detect hangups */
+  int control;
+  /* watched while blocking for IN, to be interrupted; -1 if unset */
+  int wakeup_fd;
+  FepString frame;
+};
+
+#ifdef FEP_SHM_SUPPORTED
+
+int
+_fep_shm_create (int *r_fds)
+{
+  size_t map_size = 2 * sizeof(FepShmRing);
+  FepShmRing *rings;
+  int i;
+
+  r_fds[0] = memfd_create ("fep-shm", MFD_CLOEXEC);
+  if (r_fds[0] < 0)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "can't create memfd: %s", strerror (errno));
+      return -1;
+    }
+
+  if (ftruncate (r_fds[0], map_size) < 0)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "can't resize memfd: %s", strerror (errno));
+      close (r_fds[0]);
+      return -1;
+    }
+
+  rings = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		r_fds[0], 0);
+  if (rings == MAP_FAILED)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "can't map memfd: %s", strerror (errno));
+      close (r_fds[0]);
+      return -1;
+    }
+  /* consumers start asleep so the first frame triggers a wakeup */
+  for (i = 0; i < 2; i++)
+    rings[i].waiting = 1;
+  munmap (rings, map_size);
+
+  for (i = 1; i < FEP_SHM_N_FDS; i++)
+    {
+      r_fds[i] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (r_fds[i] < 0)
+	{
+	  fep_log (FEP_LOG_LEVEL_WARNING,
+		   "can't create eventfd: %s", strerror (errno));
+	  while (--i >= 0)
+	    close (r_fds[i]);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* Take ownership of FDS created by _fep_shm_create.  The first ring
+   and eventfd carry messages from server to client, the second ones
+   the opposite.  */
+FepShm *
+_fep_shm_new (int *fds, bool is_server, int control)
+{
+  FepShm *shm;
+  FepShmRing *rings;
+  size_t map_size = 2 * sizeof(FepShmRing);
+  int i;
+
+  rings = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		fds[0], 0);
+  close (fds[0]);
+  if (rings == MAP_FAILED)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "can't map memfd: %s", strerror (errno));
+      for (i = 1; i < FEP_SHM_N_FDS; i++)
+	close (fds[i]);
+      return NULL;
+    }
+
+  shm = xzalloc (sizeof(FepShm));
+  shm->map = rings;
+  shm->map_size = map_size;
+  shm->control = control;
+  shm->wakeup_fd = -1;
+  if (is_server)
+    {
+      shm->out = &rings[0];
+      shm->out_fd = fds[1];
+      shm->in = &rings[1];
+      shm->in_fd = fds[2];
+    }
+  else
+    {
+      shm->in = &rings[0];
+      shm->in_fd = fds[1];
+      shm->out = &rings[1];
+      shm->out_fd = fds[2];
+    }
+
+  return shm;
+}
+
+void
+_fep_shm_free (FepShm *shm)
+{
+  munmap (shm->map, shm->map_size);
+  close (shm->in_fd);
+  close (shm->out_fd);
+  free (shm->frame.str);
+  free (shm);
+}
+
+#else  /* !FEP_SHM_SUPPORTED */
+
+int
+_fep_shm_create (int *r_fds)
+{
+  fep_log (FEP_LOG_LEVEL_WARNING,
+	   "shared memory transport is not supported");
+  return -1;
+}
+
+FepShm *
+_fep_shm_new (int *fds, bool is_server, int control)
+{
+  return NULL;
+}
+
+void
+_fep_shm_free (FepShm *shm)
+{
+}
+
+#endif	/* !FEP_SHM_SUPPORTED */
+
+int
+_fep_shm_get_poll_fd (FepShm *shm)
+{
+  return shm->in_fd;
+}
+
+/* Make a blocking read return early when FD becomes readable.  FD is
+   not read; draining it is left to the caller.  */
+void
+_fep_shm_set_wakeup_fd (FepShm *shm, int fd)
+{
+  shm->wakeup_fd = fd;
+}
+
+static void
+ring_copy_in (FepShmRing *ring, uint32_t pos, const char *data, size_t len)
+{
+  size_t offset = pos & (FEP_SHM_RING_SIZE - 1);
+  size_t first = MIN(len, FEP_SHM_RING_SIZE - offset);
+
+  memcpy (ring->data + offset, data, first);
+  memcpy (ring->data, data + first, len - first);
+}
+
+static void
+ring_copy_out (FepShmRing *ring, uint32_t pos, char *data, size_t len)
+{
+  size_t offset = pos & (FEP_SHM_RING_SIZE - 1);
+  size_t first = MIN(len, FEP_SHM_RING_SIZE - offset);
+
+  memcpy (data, ring->data + offset, first);
+  memcpy (data + first, ring->data, len - first);
+}
+
+static bool
+ring_is_empty (FepShmRing *ring)
+{
+  return __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE)
+    == __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+}
+
+static void
+signal_fd (int fd)
+{
+  uint64_t value = 1;
+  while (write (fd, &value, sizeof(value)) < 0 && errno == EINTR)
+    ;
+}
+
+/* Wait until the eventfd is signalled.  Returns 1 if the wakeup fd
+   has become readable instead, -1 if the peer has closed the control
+   socket, and 0 otherwise.  */
+static int
+wait_readable (FepShm *shm, int timeout)
+{
+  struct pollfd pfds[3];
+
+  pfds[0].fd = shm->in_fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = shm->control;
+  pfds[1].events = POLLIN;
+  /* poll() ignores a negative fd */
+  pfds[2].fd = shm->wakeup_fd;
+  pfds[2].events = POLLIN;
+  if (poll (pfds, 3, timeout) < 0)
+    return errno == EINTR ? 0 : -1;
+
+  /* Nothing but the hangup is expected on the control socket after
+     switching to the shared memory transport.  */
+  if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+    return -1;
+  return pfds[2].revents & POLLIN ? 1 : 0;
+}
+
+/* Mark the consumer as sleeping and reset the eventfd counter.  If
+   the ring turned out to be non-empty meanwhile, keep the eventfd
+   readable so that poll() in the caller does not block.  Returns true
+   if the eventfd had been signalled.  */
+static bool
+rearm (FepShm *shm)
+{
+  uint64_t value = 0;
+  bool woken;
+
+  __atomic_store_n (&shm->in->waiting, 1, __ATOMIC_SEQ_CST);
+  woken = read (shm->in_fd, &value, sizeof(value)) == sizeof(value);
+  if (!ring_is_empty (shm->in))
+    signal_fd (shm->in_fd);
+  return woken;
+}
+
+/* Pop a frame from the input ring into shm->frame.  Returns 1 on
+   success, 0 if the ring is empty, and -1 if the frame is malformed,
+   since the ring is written by the peer and can't be trusted.  */
+static int
+ring_pop (FepShm *shm)
+{
+  FepShmRing *ring = shm->in;
+  uint32_t head, tail, len;
+
+  head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return 0;
+
+  if (tail - head < sizeof(uint32_t))
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING, "truncated frame in shared memory");
+      return -1;
+    }
+  ring_copy_out (ring, head, (char *) &len, sizeof(uint32_t));
+  if (len > FEP_SHM_RING_SIZE - sizeof(uint32_t)
+      || sizeof(uint32_t) + len > tail - head)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "invalid frame length %u in shared memory",
+	       len);
+      return -1;
+    }
+  _fep_string_clear (&shm->frame);
+  if (shm->frame.cap < len)
+    {
+      shm->frame.str = xrealloc (shm->frame.str, len);
+      shm->frame.cap = len;
+    }
+  ring_copy_out (ring, head + sizeof(uint32_t), shm->frame.str, len);
+  shm->frame.len = len;
+  __atomic_store_n (&ring->head, head + sizeof(uint32_t) + len,
+		    __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Read a control message from the shared memory ring.  Returns 0 on
+   success, 1 if no message is available (either because BLOCK is
+   false, because the wakeup was spurious, or because the wakeup fd
+   has become readable), and -1 on error or hangup.  */
+int
+_fep_shm_read_control_message (FepShm            *shm,
+			       FepControlMessage *message,
+			       bool               block)
+{
+  while (true)
+    {
+      int retval = ring_pop (shm);
+
+      if (retval < 0)
+	return -1;
+      if (retval > 0)
+	{
+	  if (ring_is_empty (shm->in))
+	    rearm (shm);
+	  return _fep_control_message_decode (message,
+					      shm->frame.str,
+					      shm->frame.len);
+	}
+
+      if (rearm (shm) || !ring_is_empty (shm->in))
+	{
+	  if (ring_is_empty (shm->in))
+	    return 1;
+	  continue;
+	}
+
+      if (!block)
+	return 1;
+
+      switch (wait_readable (shm, -1))
+	{
+	case 1:
+	  if (ring_is_empty (shm->in))
+	    return 1;
+	  break;
+	case -1:
+	  if (ring_is_empty (shm->in))
+	    {
+	      fep_log (FEP_LOG_LEVEL_DEBUG,
+		       "connection %d closed",
+		       shm->control);
+	      return -1;
+	    }
+	  break;
+	}
+    }
+}
+
+/* Copy an encoded control message into the ring.  If the ring is full
+   and BLOCK is false, returns 1 without copying anything.  */
+int
+_fep_shm_write_frame (FepShm     *shm,
+		      const char *data,
+		      uint32_t    len,
+		      bool        block)
+{
+  FepShmRing *ring = shm->out;
+  uint32_t head, tail;
+
+  if (len + sizeof(uint32_t) > FEP_SHM_RING_SIZE)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "control message too large for shared memory: %u",
+	       len);
+      return -1;
+    }
+
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+  while (true)
+    {
+      struct pollfd pfd;
+
+      head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      if (FEP_SHM_RING_SIZE - (tail - head) >= len + sizeof(uint32_t))
+	break;
+
+      if (!block)
+	return 1;
+
+      /* The ring is full; the peer will drain it shortly.  */
+      pfd.fd = shm->control;
+      pfd.events = POLLIN;
+      if (poll (&pfd, 1, 1) > 0)
+	return -1;
+    }
+
+  ring_copy_in (ring, tail, (char *) &len, sizeof(uint32_t));
+  ring_copy_in (ring, tail + sizeof(uint32_t), data, len);
+  __atomic_store_n (&ring->tail, tail + sizeof(uint32_t) + len,
+		    __ATOMIC_SEQ_CST);
+
+  if (__atomic_exchange_n (&ring->waiting, 0, __ATOMIC_SEQ_CST))
+    signal_fd (shm->out_fd);
+
+  return 0;
+}
+
+/* Write MESSAGE to the ring.  If the ring is full and BLOCK is false,
+   returns 1 without writing anything.  */
+int
+_fep_shm_write_control_message (FepShm            *shm,
+				FepControlMessage *message,
+				bool               block)
+{
+  FepString buf;
+  int retval;
+
+  memset (&buf, 0, sizeof(FepString));
+  _fep_control_message_encode (message, &buf);
+  retval = _fep_shm_write_frame (shm, buf.str, buf.len, block);
+  free (buf.str);
+  if (retval != 0)
+    return retval;
+
+  _fep_log_control_message ("write", message);
+  return 0;
+}
+
+int
+_fep_send_fds (int fd, const int *fds, size_t n_fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char byte = 0;
+  char *control;
+  ssize_t retval;
+
+  control = xzalloc (CMSG_SPACE (n_fds * sizeof(int)));
+
+  memset (&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE (n_fds * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (n_fds * sizeof(int));
+  memcpy (CMSG_DATA (cmsg), fds, n_fds * sizeof(int));
+
+  do
+    retval = sendmsg (fd, &msg, 0);
+  while (retval < 0 && errno == EINTR);
+  free (control);
+
+  if (retval < 1)
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "failed to send descriptors to %d: %s",
+	       fd, strerror (errno));
+      return -1;
+    }
+  return 0;
+}
+
+int
+_fep_receive_fds (int fd, int *fds, size_t n_fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char byte;
+  char *control;
+  ssize_t retval;
+
+  control = xzalloc (CMSG_SPACE (n_fds * sizeof(int)));
+
+  memset (&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE (n_fds * sizeof(int));
+
+  do
+    retval = recvmsg (fd, &msg, MSG_CMSG_CLOEXEC);
+  while (retval < 0 && errno == EINTR);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (retval < 1
+      || cmsg == NULL
+      || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (n_fds * sizeof(int)))
+    {
+      fep_log (FEP_LOG_LEVEL_WARNING,
+	       "failed to receive descriptors from %d",
+	       fd);
+      free (control);
+      return -1;
+    }
+
+  memcpy (fds, CMSG_DATA (cmsg), n_fds * sizeof(int));
+  free (control);
+  return 0;
+}
@@ -38,6 +38,7 @@ usage (FILE *out, const char *program_name)
 	   "  -s, --status-text=TEXT\tRender text at the bottom\n"
 	   "  -d, --send-text=TEXT\tSend text to the child process\n"
 	   "  -e, --listen-event\tListen to an event from server\n"
+	   "  -m, --shared-memory\tUse the shared memory transport\n"
 	   "  -l, --log-file=FILE\tLog file\n"
 	   "  -h, --help\tShow this help\n",
 	   program_name);
@@ -52,6 +53,13 @@ event_filter (FepEvent *event)
       printf ("keyval = %u, modifiers = %u\n",
 	      _event->keyval, _event->modifiers);
     }
+  else if (event->type == FEP_MOUSE)
+    {
+      FepEventMouse *_event = (FepEventMouse *)event;
+      printf ("action = %u, button = %u, modifiers = %u, col = %u, row = %u\n",
+	      _event->action, _event->button, _event->modifiers,
+	      _event->col, _event->row);
+    }
   else
     printf ("unknown event %u\n", event->type);
   return 1;
@@ -64,6 +72,7 @@ main (int argc, char **argv)
   int c;
   char *cursor_text = NULL, *status_text = NULL, *send_text = NULL;
   bool listen_event = false;
+  FepClientFlags flags = FEP_CLIENT_NONE;
   char *log_file = NULL;
 
   while (1)
@@ -75,11 +84,12 @@ main (int argc, char **argv)
 	  { "status-text", required_argument, 0, 's' },
 	  { "send-text", required_argument, 0, 'd' },
 	  { "listen-event", no_argument, 0, 'e' },
+	  { "shared-memory", no_argument, 0, 'm' },
 	  { "log-file", no_argument, 0, 'l' },
 	  { "help", no_argument, 0, 'h' },
 	  { NULL, 0, 0, 0 }
 	};
-      c = getopt_long (argc, argv, "c:s:d:el:h",
+      c = getopt_long (argc, argv, "c:s:d:eml:h",
 		       long_options, &option_index);
       if (c == -1)
 	break;
@@ -98,6 +108,9 @@ main (int argc, char **argv)
 	case 'e':
 	  listen_event = true;
 	  break;
+	case 'm':
+	  flags |= FEP_CLIENT_SHM;
+	  break;
 	case 'l':
 	  log_file = optarg;
 	  break;
@@ -130,7 +143,7 @@ main (int argc, char **argv)
       fep_set_log_level (FEP_LOG_LEVEL_DEBUG);
     }
 
-  client = fep_client_open (NULL);
+  client = fep_client_open_full (NULL, flags);
   if (!client)
     {
       fprintf (stderr, "Can't open FEP control socket\n");
@@ -157,6 +170,11 @@ main (int argc, char **argv)
       fep_client_set_event_filter (client,
 				   (FepEventFilter) event_filter,
 				   NULL);
+      fep_client_subscribe_keys (client,
+				 FEP_KEY_SUBSCRIBE_ALL
+				 | FEP_KEY_SUBSCRIBE_MOUSE,
+				 NULL,
+				 0);
       printf ("# waiting for an event\n");
       if (fep_client_dispatch (client) < 0)
 	{